@@ -0,0 +1,98 @@
+/*!
+@file
+@copyright Nils Deppe 2018
+(See accompanying file LICENSE.md or copy at http://boost.org/LICENSE_1_0.txt)
+*/
+
+/*!
+ * \brief An example stage for `flamegraph_filter --plugin`, which removes the
+ * argument list from frame names, e.g. `solve(double*, int)` becomes `solve`,
+ * so that the overloads of a function are merged.
+ *
+ * Build it with `-DBUILD_EXAMPLE_PLUGIN=ON` and run
+ * `flamegraph_filter --plugin ./libstrip_arguments_plugin.so out.folded`.
+ */
+
+#include <cstdint>
+#include <new>
+#include <vector>
+
+#include "flamegraph_filter_plugin.h"
+
+namespace {
+constexpr uint32_t unknown_frame = UINT32_MAX;
+
+struct StripArguments {
+  const fgf_host* host;
+  /// The ID of the stripped name of each frame ID seen so far. Frame names
+  /// may only be read during a call from the host, so they are not kept.
+  std::vector<uint32_t> stripped_ids;
+};
+
+/*!
+ * \brief Returns the length of the name without its trailing argument list,
+ * which may contain parentheses itself, or `length` if it has none
+ */
+size_t length_without_arguments(const char* const name, const size_t length) {
+  if (length == 0 or name[length - 1] != ')') {
+    return length;
+  }
+  size_t depth = 0;
+  for (size_t i = length; i > 1; --i) {
+    if (name[i - 1] == ')') {
+      ++depth;
+    } else if (name[i - 1] == '(' and --depth == 0) {
+      return i - 1;
+    }
+  }
+  return length;
+}
+
+void* create(const fgf_host* const host, const char* const argument) {
+  // The plugin takes no argument
+  if (argument[0] != '\0') {
+    return nullptr;
+  }
+  return new (std::nothrow) StripArguments{host, {}};
+}
+
+int process_batch(void* const state, fgf_stack_batch* const batch) {
+  auto& strip_arguments = *static_cast<StripArguments*>(state);
+  const fgf_host& host = *strip_arguments.host;
+  auto& stripped_ids = strip_arguments.stripped_ids;
+  try {
+    for (size_t i = 0; i < batch->number_of_stacks; ++i) {
+      uint32_t* const frame_ids = batch->frame_ids + batch->stack_offsets[i];
+      for (uint32_t j = 0; j < batch->stack_lengths[i]; ++j) {
+        const uint32_t frame_id = frame_ids[j];
+        if (frame_id >= stripped_ids.size()) {
+          stripped_ids.resize(frame_id + size_t{1}, unknown_frame);
+        }
+        if (stripped_ids[frame_id] == unknown_frame) {
+          size_t length = 0;
+          const char* const name =
+              host.frame_name(host.context, frame_id, &length);
+          const size_t stripped_length = length_without_arguments(name, length);
+          stripped_ids[frame_id] =
+              stripped_length == length
+                  ? frame_id
+                  : host.intern_frame(host.context, name, stripped_length);
+        }
+        frame_ids[j] = stripped_ids[frame_id];
+      }
+    }
+  } catch (...) {
+    return 1;
+  }
+  return 0;
+}
+
+void destroy(void* const state) { delete static_cast<StripArguments*>(state); }
+}  // namespace
+
+extern "C" const fgf_stage_plugin* fgf_stage_plugin_entry() {
+  static const fgf_stage_plugin plugin = {FGF_PLUGIN_ABI_VERSION,
+                                          "strip-arguments", &create,
+                                          &process_batch, &destroy};
+  return &plugin;
+}
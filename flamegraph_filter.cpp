@@ -5,173 +5,5239 @@
 */
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <boost/program_options.hpp>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <exception>
 #include <fstream>
+#include <functional>
+#include <initializer_list>
 #include <iostream>
+#include <iterator>
+#include <limits>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <numeric>
 #include <regex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <tuple>
 #include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <utime.h>
+
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#include <linux/perf_event.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+// Set by CMake if the kernel headers have io_uring with IORING_OP_READ, which
+// older distributions lack; the files are then read with pread only
+#if defined(FLAMEGRAPH_FILTER_HAVE_IO_URING) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define FLAMEGRAPH_FILTER_USE_IO_URING
+#endif
+
+#include "flamegraph_filter_plugin.h"
+
 namespace po = boost::program_options;
 
 /*!
- * \brief Stream operator for `std::vector` is require by Boost.ProgramOptions
+ * \brief Stream operator for `std::vector` is require by Boost.ProgramOptions
+ */
+template <class T>
+std::ostream& operator<<(std::ostream& os, const std::vector<T>& v) {
+  os << "(";
+  std::copy(v.begin(), std::prev(v.end()), std::ostream_iterator<T>(os, ", "));
+  os << v.back() << ")";
+  return os;
+}
+
+/*!
+ * \brief Running totals of heap allocations made through the global `operator
+ * new`. Only updated when built with `ENABLE_ALLOCATION_STATS`.
+ */
+namespace allocation_stats {
+std::atomic<size_t> allocations{0};
+std::atomic<size_t> allocated_bytes{0};
+
+constexpr bool enabled() {
+#ifdef FLAMEGRAPH_FILTER_ALLOCATION_STATS
+  return true;
+#else
+  return false;
+#endif
+}
+}  // namespace allocation_stats
+
+/*!
+ * \brief Counters read by the `--progress` monitor thread. The pipeline
+ * stages only store to these with relaxed ordering so updating them is cheap.
+ */
+namespace progress {
+std::atomic<const char*> stage{"start"};
+std::atomic<size_t> bytes_processed_by_this_process{0};
+/// Points to `bytes_processed_by_this_process`, or to a counter in shared
+/// memory while worker processes parse files for this process
+std::atomic<size_t>* bytes_processed = &bytes_processed_by_this_process;
+/// Held while a report is printed and while `bytes_processed` is changed or
+/// the process forks, so a forked child never inherits a lock taken by the
+/// monitor thread
+std::mutex report_mutex{};
+}  // namespace progress
+
+#ifdef FLAMEGRAPH_FILTER_ALLOCATION_STATS
+// The replacements are kept out of line: once GCC inlines the `malloc` and
+// `free` in their bodies it pairs them with the caller's `new` and `delete`
+// expressions and warns about a mismatched deallocation
+// (-Wmismatched-new-delete)
+#define FLAMEGRAPH_FILTER_NOINLINE __attribute__((noinline))
+
+FLAMEGRAPH_FILTER_NOINLINE void* operator new(size_t size) {
+  allocation_stats::allocations.fetch_add(1, std::memory_order_relaxed);
+  allocation_stats::allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+  if (void* ptr = std::malloc(size == 0 ? 1 : size)) {
+    return ptr;
+  }
+  throw std::bad_alloc{};
+}
+
+FLAMEGRAPH_FILTER_NOINLINE void* operator new[](size_t size) {
+  return operator new(size);
+}
+
+FLAMEGRAPH_FILTER_NOINLINE void* operator new(
+    size_t size, const std::nothrow_t& /*tag*/) noexcept {
+  try {
+    return operator new(size);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+FLAMEGRAPH_FILTER_NOINLINE void* operator new[](
+    size_t size, const std::nothrow_t& tag) noexcept {
+  return operator new(size, tag);
+}
+
+FLAMEGRAPH_FILTER_NOINLINE void operator delete(void* ptr) noexcept {
+  std::free(ptr);
+}
+
+FLAMEGRAPH_FILTER_NOINLINE void operator delete[](void* ptr) noexcept {
+  std::free(ptr);
+}
+
+FLAMEGRAPH_FILTER_NOINLINE void operator delete(
+    void* ptr, const std::nothrow_t& /*tag*/) noexcept {
+  std::free(ptr);
+}
+
+FLAMEGRAPH_FILTER_NOINLINE void operator delete[](
+    void* ptr, const std::nothrow_t& /*tag*/) noexcept {
+  std::free(ptr);
+}
+
+#undef FLAMEGRAPH_FILTER_NOINLINE
+#endif
+
+/*!
+ * \brief Hardware performance counters read with Linux `perf_event_open`
+ *
+ * If the counters cannot be opened (not Linux, restrictive
+ * `perf_event_paranoid`, running in a container) `available()` returns false
+ * and the statistics are reported without them.
+ */
+class PerfCounters {
+ public:
+  static constexpr size_t number_of_counters = 4;
+  using Values = std::array<uint64_t, number_of_counters>;
+
+  static const std::array<const char*, number_of_counters>& names() {
+    static const std::array<const char*, number_of_counters> counter_names{
+        {"cycles", "instructions", "cache_misses", "branch_misses"}};
+    return counter_names;
+  }
+
+  PerfCounters() {
+    file_descriptors_.fill(-1);
+#ifdef __linux__
+    const std::array<uint64_t, number_of_counters> configs{
+        {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+         PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES}};
+    for (size_t i = 0; i < number_of_counters; ++i) {
+      perf_event_attr attributes{};
+      attributes.type = PERF_TYPE_HARDWARE;
+      attributes.size = sizeof(attributes);
+      attributes.config = configs[i];
+      attributes.exclude_kernel = 1;
+      attributes.exclude_hv = 1;
+      attributes.inherit = 1;
+      file_descriptors_[i] = static_cast<int>(
+          syscall(__NR_perf_event_open, &attributes, 0, -1, -1, 0));
+      if (file_descriptors_[i] < 0) {
+        close_all();
+        return;
+      }
+    }
+#endif
+  }
+
+  PerfCounters(const PerfCounters&) = delete;
+  PerfCounters& operator=(const PerfCounters&) = delete;
+
+  ~PerfCounters() { close_all(); }
+
+  bool available() const { return file_descriptors_[0] >= 0; }
+
+  /// The current value of each counter, all zero if `available()` is false
+  Values read() const {
+    Values values{};
+#ifdef __linux__
+    if (available()) {
+      for (size_t i = 0; i < number_of_counters; ++i) {
+        uint64_t value = 0;
+        if (::read(file_descriptors_[i], &value, sizeof(value)) ==
+            sizeof(value)) {
+          values[i] = value;
+        }
+      }
+    }
+#endif
+    return values;
+  }
+
+ private:
+  void close_all() {
+#ifdef __linux__
+    for (auto& file_descriptor : file_descriptors_) {
+      if (file_descriptor >= 0) {
+        ::close(file_descriptor);
+      }
+      file_descriptor = -1;
+    }
+#endif
+  }
+
+  std::array<int, number_of_counters> file_descriptors_;
+};
+
+/*!
+ * \brief Wall time, allocations, and hardware counters spent in one stage of
+ * the pipeline
+ */
+struct StageStats {
+  std::string name;
+  double seconds;
+  size_t allocations;
+  size_t allocated_bytes;
+  PerfCounters::Values hardware_counters;
+};
+
+/*!
+ * \brief The statistics of a full run of the filter
+ */
+struct PipelineStats {
+  size_t input_bytes = 0;
+  PerfCounters counters{};
+  std::vector<StageStats> stages{};
+};
+
+/*!
+ * \brief Runs `stage` and, if `stats` is not null, records the time,
+ * allocations, and hardware counters it took under `name`
+ */
+template <class Stage>
+auto run_stage(PipelineStats* const stats, const char* const name,
+               Stage&& stage) -> decltype(stage()) {
+  progress::stage.store(name, std::memory_order_relaxed);
+  if (stats == nullptr) {
+    return stage();
+  }
+  const size_t allocations_before = allocation_stats::allocations.load();
+  const size_t bytes_before = allocation_stats::allocated_bytes.load();
+  const PerfCounters::Values counters_before = stats->counters.read();
+  const auto start = std::chrono::steady_clock::now();
+  auto result = stage();
+  const auto stop = std::chrono::steady_clock::now();
+  PerfCounters::Values counters = stats->counters.read();
+  for (size_t i = 0; i < counters.size(); ++i) {
+    counters[i] -= counters_before[i];
+  }
+  stats->stages.push_back(StageStats{
+      name, std::chrono::duration<double>(stop - start).count(),
+      allocation_stats::allocations.load() - allocations_before,
+      allocation_stats::allocated_bytes.load() - bytes_before, counters});
+  return result;
+}
+
+/*!
+ * \brief Print the per-stage statistics collected by `run_stage` to `os`
+ */
+void print_stage_stats(std::ostream& os, const PipelineStats& stats) {
+  char buffer[256];
+  std::snprintf(buffer, sizeof(buffer), "%-10s %12s %14s %16s", "stage",
+                "time (s)", "allocations", "bytes allocated");
+  os << buffer;
+  if (stats.counters.available()) {
+    for (const auto& counter_name : PerfCounters::names()) {
+      std::snprintf(buffer, sizeof(buffer), " %14s/B", counter_name);
+      os << buffer;
+    }
+  }
+  os << '\n';
+  const double input_bytes =
+      static_cast<double>(std::max(stats.input_bytes, size_t{1}));
+  for (const auto& stage : stats.stages) {
+    if (allocation_stats::enabled()) {
+      std::snprintf(buffer, sizeof(buffer), "%-10s %12.6f %14zu %16zu",
+                    stage.name.c_str(), stage.seconds, stage.allocations,
+                    stage.allocated_bytes);
+    } else {
+      std::snprintf(buffer, sizeof(buffer), "%-10s %12.6f %14s %16s",
+                    stage.name.c_str(), stage.seconds, "n/a", "n/a");
+    }
+    os << buffer;
+    if (stats.counters.available()) {
+      for (const auto& value : stage.hardware_counters) {
+        std::snprintf(buffer, sizeof(buffer), " %16.4f",
+                      static_cast<double>(value) / input_bytes);
+        os << buffer;
+      }
+    }
+    os << '\n';
+  }
+  if (allocation_stats::enabled()) {
+    os << "Allocation counts are global, so allocations of the --progress, "
+          "--split-by and --sort threads count towards the running stage\n";
+  } else {
+    os << "Allocation counts require building with "
+          "-DENABLE_ALLOCATION_STATS=ON\n";
+  }
+  if (not stats.counters.available()) {
+    os << "Hardware counters are unavailable (perf_event_open failed)\n";
+  }
+}
+
+/*!
+ * \brief Write the per-stage statistics collected by `run_stage` as JSON.
+ * Values that were not collected are written as `null`.
+ */
+void write_stage_stats_json(const PipelineStats& stats,
+                            const std::string& out_filename) {
+  std::ofstream out_file(out_filename);
+  if (not out_file.is_open()) {
+    std::cerr << "Could not open file: " << out_filename << " for writing\n";
+    std::exit(1);
+  }
+  const double input_bytes =
+      static_cast<double>(std::max(stats.input_bytes, size_t{1}));
+  out_file << "{\n  \"input_bytes\": " << stats.input_bytes
+           << ",\n  \"stages\": [";
+  for (size_t i = 0; i < stats.stages.size(); ++i) {
+    const auto& stage = stats.stages[i];
+    out_file << (i == 0 ? "" : ",") << "\n    {\"name\": \"" << stage.name
+             << "\", \"seconds\": " << stage.seconds;
+    if (allocation_stats::enabled()) {
+      out_file << ", \"allocations\": " << stage.allocations
+               << ", \"allocated_bytes\": " << stage.allocated_bytes;
+    } else {
+      out_file << ", \"allocations\": null, \"allocated_bytes\": null";
+    }
+    for (size_t j = 0; j < PerfCounters::number_of_counters; ++j) {
+      const std::string counter_name = PerfCounters::names()[j];
+      if (stats.counters.available()) {
+        out_file << ", \"" << counter_name
+                 << "\": " << stage.hardware_counters[j] << ", \""
+                 << counter_name << "_per_byte\": "
+                 << static_cast<double>(stage.hardware_counters[j]) /
+                        input_bytes;
+      } else {
+        out_file << ", \"" << counter_name << "\": null, \"" << counter_name
+                 << "_per_byte\": null";
+      }
+    }
+    out_file << "}";
+  }
+  out_file << "\n  ]\n}\n";
+  out_file.close();
+}
+
+/*!
+ * \brief Prints and/or writes the statistics as requested by `--stats` and
+ * `--stats-json`
+ */
+void report_stats(const po::variables_map& args,
+                  const PipelineStats* const stats) {
+  if (args.count("stats")) {
+    print_stage_stats(std::cerr, *stats);
+  }
+  if (args.count("stats-json")) {
+    write_stage_stats_json(*stats, args["stats-json"].as<std::string>());
+  }
+}
+
+/*!
+ * \brief Periodically reports the bytes processed, throughput, estimated time
+ * remaining, and current stage to stderr from a separate thread until
+ * destroyed
+ */
+class ProgressMonitor {
+ public:
+  ProgressMonitor(const size_t total_bytes, const double interval_seconds)
+      : total_bytes_(total_bytes),
+        interval_(std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::duration<double>(std::max(interval_seconds, 0.01)))),
+        thread_([this]() { monitor(); }) {}
+
+  ProgressMonitor(const ProgressMonitor&) = delete;
+  ProgressMonitor& operator=(const ProgressMonitor&) = delete;
+
+  ~ProgressMonitor() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      done_ = true;
+    }
+    condition_.notify_one();
+    thread_.join();
+  }
+
+ private:
+  void monitor() {
+    const auto start = std::chrono::steady_clock::now();
+    auto previous_time = start;
+    size_t previous_bytes = 0;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (not condition_.wait_for(lock, interval_,
+                                   [this]() { return done_; })) {
+      std::lock_guard<std::mutex> report_lock(progress::report_mutex);
+      const auto now = std::chrono::steady_clock::now();
+      const size_t bytes =
+          progress::bytes_processed->load(std::memory_order_relaxed);
+      const double megabytes_per_second =
+          static_cast<double>(bytes - previous_bytes) / 1.0e6 /
+          std::chrono::duration<double>(now - previous_time).count();
+      char eta[32] = "unknown";
+      if (megabytes_per_second > 0.0 and bytes < total_bytes_) {
+        std::snprintf(eta, sizeof(eta), "%.0fs",
+                      static_cast<double>(total_bytes_ - bytes) / 1.0e6 /
+                          megabytes_per_second);
+      }
+      char buffer[256];
+      std::snprintf(
+          buffer, sizeof(buffer),
+          "[%7.1fs] %-8s %10.1f / %.1f MB (%5.1f%%) %8.1f MB/s  ETA %s\n",
+          std::chrono::duration<double>(now - start).count(),
+          progress::stage.load(std::memory_order_relaxed),
+          static_cast<double>(bytes) / 1.0e6,
+          static_cast<double>(total_bytes_) / 1.0e6,
+          total_bytes_ == 0 ? 100.0
+                            : 100.0 * static_cast<double>(bytes) /
+                                  static_cast<double>(total_bytes_),
+          megabytes_per_second, eta);
+      std::cerr << buffer << std::flush;
+      previous_time = now;
+      previous_bytes = bytes;
+    }
+  }
+
+  const size_t total_bytes_;
+  const std::chrono::milliseconds interval_;
+  bool done_ = false;
+  std::mutex mutex_{};
+  std::condition_variable condition_{};
+  std::thread thread_;
+};
+
+/*!
+ * \brief Returns the size of the file in bytes, or zero if it cannot be opened
+ */
+size_t get_file_size(const std::string& filename) {
+  std::ifstream file(filename, std::ios::binary | std::ios::ate);
+  return file.is_open() ? static_cast<size_t>(file.tellg()) : 0;
+}
+
+/*!
+ * \brief Hashes `size` bytes starting at `data` into `hash` using a
+ * word-at-a-time variant of 64-bit FNV-1a
+ */
+uint64_t hash_bytes(const char* data, size_t size,
+                    uint64_t hash = 14695981039346656037ULL) {
+  constexpr uint64_t prime = 1099511628211ULL;
+  for (; size >= sizeof(uint64_t);
+       size -= sizeof(uint64_t), data += sizeof(uint64_t)) {
+    uint64_t word = 0;
+    std::memcpy(&word, data, sizeof(word));
+    hash = (hash ^ word) * prime;
+  }
+  for (; size > 0; --size, ++data) {
+    hash = (hash ^ static_cast<unsigned char>(*data)) * prime;
+  }
+  return hash;
+}
+
+/*!
+ * \brief Hashes the first `bytes` bytes of the file, or all of it.
+ *
+ * If `prefix_hash` is given it is set to the hash of the first `prefix_bytes`
+ * bytes, which must not be more than `bytes`, as this function would return
+ * it, so that a prefix can be checked in the same read as the whole file.
+ */
+uint64_t hash_file(const std::string& filename,
+                   const size_t bytes = std::numeric_limits<size_t>::max(),
+                   const size_t prefix_bytes = 0,
+                   uint64_t* const prefix_hash = nullptr) {
+  std::ifstream file(filename, std::ios::binary);
+  if (not file.is_open()) {
+    std::cerr << "Could not open file: " << filename << " for reading\n";
+    std::exit(1);
+  }
+  // Both hashes are taken over the same 1 MiB blocks from the start of the
+  // file, since the result depends on where the blocks end
+  constexpr size_t block_size = size_t{1} << 20;
+  std::vector<char> buffer(block_size);
+  uint64_t hash = hash_bytes(nullptr, 0);
+  if (prefix_hash != nullptr) {
+    *prefix_hash = hash;
+  }
+  size_t position = 0;
+  while (file and position < bytes) {
+    file.read(buffer.data(),
+              static_cast<std::streamsize>(std::min(block_size,
+                                                    bytes - position)));
+    const auto size = static_cast<size_t>(file.gcount());
+    if (prefix_hash != nullptr and position < prefix_bytes) {
+      *prefix_hash = hash_bytes(
+          buffer.data(), std::min(size, prefix_bytes - position), *prefix_hash);
+    }
+    hash = hash_bytes(buffer.data(), size, hash);
+    position += size;
+  }
+  return hash;
+}
+
+/*!
+ * \brief Hashes the first and last 64 KiB of the first `bytes` bytes of the
+ * file, and `bytes` itself, so that a large file can be recognized without
+ * reading all of it
+ */
+uint64_t hash_file_edges(const std::string& filename, const size_t bytes) {
+  constexpr size_t edge_bytes = size_t{1} << 16;
+  std::ifstream file(filename, std::ios::binary);
+  if (not file.is_open()) {
+    std::cerr << "Could not open file: " << filename << " for reading\n";
+    std::exit(1);
+  }
+  const size_t head_bytes = std::min(bytes, edge_bytes);
+  const size_t tail_begin = std::max(head_bytes, bytes - head_bytes);
+  std::vector<char> buffer(head_bytes + (bytes - tail_begin));
+  file.read(buffer.data(), static_cast<std::streamsize>(head_bytes));
+  file.seekg(static_cast<std::streamoff>(tail_begin));
+  file.read(buffer.data() + head_bytes,
+            static_cast<std::streamsize>(bytes - tail_begin));
+  if (not file) {
+    // The file is shorter than `bytes`, so it cannot be the hashed data
+    return 0;
+  }
+  const auto size = static_cast<uint64_t>(bytes);
+  return hash_bytes(buffer.data(), buffer.size(),
+                    hash_bytes(reinterpret_cast<const char*>(&size),
+                               sizeof(size)));
+}
+
+/*!
+ * \brief The kinds of frames that stackcollapse scripts mark by appending
+ * `_[k]` (kernel), `_[j]` (JIT compiled), or `_[i]` (inlined) to their names.
+ * Frames without an annotation are user frames.
+ */
+namespace frame_kind {
+constexpr uint8_t user = 1;
+constexpr uint8_t kernel = 2;
+constexpr uint8_t jit = 4;
+constexpr uint8_t inlined = 8;
+
+/// The kind of a frame, from the annotation at the end of its name
+uint8_t of(const std::string& frame) {
+  const size_t size = frame.size();
+  if (size < 4 or frame.compare(size - 4, 2, "_[") != 0 or
+      frame[size - 1] != ']') {
+    return user;
+  }
+  switch (frame[size - 2]) {
+    case 'k':
+      return kernel;
+    case 'j':
+      return jit;
+    case 'i':
+      return inlined;
+    default:
+      return user;
+  }
+}
+
+/// The kinds named in a comma separated list such as `kernel,jit`
+uint8_t parse(const std::string& kinds) {
+  uint8_t mask = 0;
+  std::istringstream names(kinds);
+  for (std::string name{}; std::getline(names, name, ',');) {
+    if (name == "user") {
+      mask |= user;
+    } else if (name == "kernel") {
+      mask |= kernel;
+    } else if (name == "jit") {
+      mask |= jit;
+    } else if (name == "inlined") {
+      mask |= inlined;
+    } else {
+      throw std::invalid_argument("Unknown frame kind '" + name +
+                                  "', expected user, kernel, jit, or inlined");
+    }
+  }
+  return mask;
+}
+}  // namespace frame_kind
+
+/*!
+ * \brief Returns whether the filter runs on a `FoldedProfile` of interned
+ * frames rather than on the map of lines built by `build_stack_map`
+ */
+bool uses_profile(const po::variables_map& args) {
+  return args.count("index") or args.count("focus") or args.count("hide") or
+         args.count("match") or args.count("rename") or
+         args.count("metrics") or args.count("metric") or
+         args.count("drop-frames") or args.count("keep-only-frames") or
+         args.count("collapse-frames") or args.count("split-by") or
+         args.count("sort") or args.count("plugin") or
+         args.count("normalize-root-frames") or
+         args.count("shm") or args.count("input-list") or
+         args.count("merge-partials") or
+         (args.count("input-file") and
+          args["input-file"].as<std::vector<std::string>>().size() > 1);
+}
+
+/*!
+ * \brief Returns the input files given on the command line followed by those
+ * listed, one per line, in the `--input-list` file
+ */
+std::vector<std::string> get_input_filenames(const po::variables_map& args) {
+  std::vector<std::string> filenames{};
+  if (args.count("input-file")) {
+    filenames = args["input-file"].as<std::vector<std::string>>();
+  }
+  if (args.count("input-list")) {
+    const auto& list_filename = args["input-list"].as<std::string>();
+    std::ifstream list_file(list_filename);
+    if (not list_file.is_open()) {
+      std::cerr << "Could not open file: " << list_filename << " for reading\n";
+      std::exit(1);
+    }
+    std::string filename{};
+    while (std::getline(list_file, filename)) {
+      if (not filename.empty()) {
+        filenames.push_back(filename);
+      }
+    }
+  }
+  return filenames;
+}
+
+/*!
+ * \brief Returns the names of the value columns of the input given with
+ * `--metrics`, or `samples` for the single column of plain folded files
+ */
+std::vector<std::string> get_metric_names(const po::variables_map& args) {
+  std::vector<std::string> metric_names{};
+  if (args.count("metrics")) {
+    std::istringstream names(args["metrics"].as<std::string>());
+    for (std::string name{}; std::getline(names, name, ',');) {
+      metric_names.push_back(name);
+    }
+  }
+  if (metric_names.empty()) {
+    metric_names.push_back("samples");
+  }
+  return metric_names;
+}
+
+/*!
+ * \brief Returns the options that change the filtered output in a canonical
+ * form, so that equivalent invocations share a cache entry.
+ *
+ * Any new option that affects the output must be added here.
+ */
+std::string normalized_cache_options(const po::variables_map& args) {
+  std::ostringstream options{};
+  options.precision(17);
+  options << "version=1;profile="
+          << uses_profile(args)
+          << ";cutoff-percentage=" << args["cutoff-percentage"].as<double>()
+          << ";stack-limit=" << args["stack-limit"].as<size_t>();
+  for (const char* const kinds_option :
+       {"drop-frames", "keep-only-frames", "collapse-frames"}) {
+    options << ';' << kinds_option << '='
+            << (args.count(kinds_option)
+                    ? static_cast<int>(frame_kind::parse(
+                          args[kinds_option].as<std::string>()))
+                    : 0);
+  }
+  options << ";normalize-root-frames="
+          << (args.count("normalize-root-frames")
+                  ? args["normalize-root-frames"].as<std::string>()
+                  : "");
+  options << ";sort="
+          << (args.count("sort") ? args["sort"].as<std::string>() : "");
+  options << ";metrics=";
+  for (const auto& metric_name : get_metric_names(args)) {
+    options << metric_name.size() << ':' << metric_name;
+  }
+  options << ";metric="
+          << (args.count("metric") ? args["metric"].as<std::string>() : "");
+  // Rename rules are applied in order, each to the result of the previous one
+  options << ";rename=";
+  if (args.count("rename")) {
+    for (const auto& rule : args["rename"].as<std::vector<std::string>>()) {
+      options << rule.size() << ':' << rule;
+    }
+  }
+  // The order of regular expressions and patterns does not change the output
+  for (const char* const regex_option : {"show", "focus", "hide", "match"}) {
+    options << ';' << regex_option << '=';
+    if (args.count(regex_option)) {
+      auto regexes = args[regex_option].as<std::vector<std::string>>();
+      std::sort(regexes.begin(), regexes.end());
+      regexes.erase(std::unique(regexes.begin(), regexes.end()),
+                    regexes.end());
+      for (const auto& regex : regexes) {
+        options << regex.size() << ':' << regex;
+      }
+    }
+  }
+  return options.str();
+}
+
+/*!
+ * \brief A cache entry: the file it is stored in and what it was computed from
+ */
+struct CacheEntry {
+  std::string name;
+  /// The normalized options and the size and content hash of each input file.
+  /// It is stored at the start of the entry and compared on every hit, so
+  /// that a collision of the 64-bit hash in `name` is a miss, not wrong output.
+  std::string description;
+};
+
+constexpr char cache_entry_magic[8] = {'F', 'G', 'F', 'C', 'A', 'C', '0', '2'};
+
+/*!
+ * \brief Returns the cache entry for the input files filtered with the given
+ * normalized options
+ */
+CacheEntry cache_entry(const std::vector<std::string>& input_filenames,
+                       const std::string& normalized_options) {
+  CacheEntry entry{};
+  entry.description = normalized_options;
+  for (const auto& input_filename : input_filenames) {
+    entry.description += ";input=" +
+                         std::to_string(get_file_size(input_filename)) + ':' +
+                         std::to_string(hash_file(input_filename));
+  }
+  char name[32];
+  std::snprintf(name, sizeof(name), "%016llx.folded",
+                static_cast<unsigned long long>(hash_bytes(
+                    entry.description.data(), entry.description.size())));
+  entry.name = name;
+  return entry;
+}
+
+/*!
+ * \brief Copies the cached output to `out_filename` if the entry exists and
+ * was computed from the same inputs and options, and marks it as recently
+ * used. Returns whether the entry was found.
+ */
+bool fetch_cached_output(const std::string& cache_dir, const CacheEntry& entry,
+                         const std::string& out_filename) {
+  const std::string entry_path = cache_dir + "/" + entry.name;
+  std::ifstream entry_file(entry_path, std::ios::binary);
+  char magic[sizeof(cache_entry_magic)];
+  uint64_t description_size = 0;
+  if (not entry_file.read(magic, sizeof(magic)) or
+      not std::equal(magic, magic + sizeof(magic), cache_entry_magic) or
+      not entry_file.read(reinterpret_cast<char*>(&description_size),
+                          sizeof(description_size)) or
+      description_size != entry.description.size()) {
+    return false;
+  }
+  std::string description(entry.description.size(), '\0');
+  if (not entry_file.read(&description[0],
+                          static_cast<std::streamsize>(description.size())) or
+      description != entry.description) {
+    return false;
+  }
+  std::ofstream out_file(out_filename, std::ios::binary);
+  if (not out_file.is_open()) {
+    return false;
+  }
+  // An empty output makes `operator<<` set the failbit without copying
+  if (entry_file.peek() != std::ifstream::traits_type::eof()) {
+    out_file << entry_file.rdbuf();
+  }
+  out_file.close();
+  if (not out_file) {
+    return false;
+  }
+  ::utime(entry_path.c_str(), nullptr);
+  return true;
+}
+
+/*!
+ * \brief Stores the output file in the cache and then evicts the least
+ * recently used entries until the cache is no larger than `max_cache_bytes`
+ */
+void store_cached_output(const std::string& cache_dir,
+                         const CacheEntry& stored_entry,
+                         const std::string& out_filename,
+                         const size_t max_cache_bytes) {
+  if (::mkdir(cache_dir.c_str(), 0755) != 0 and errno != EEXIST) {
+    std::cerr << "Could not create cache directory: " << cache_dir << "\n";
+    return;
+  }
+  // Write to a temporary file first so that concurrent runs never see a
+  // partially written entry
+  const std::string temporary_path = cache_dir + "/" + stored_entry.name +
+                                     ".tmp." + std::to_string(::getpid());
+  bool stored = false;
+  {
+    std::ifstream out_file(out_filename, std::ios::binary);
+    std::ofstream entry_file(temporary_path, std::ios::binary);
+    if (out_file.is_open() and entry_file.is_open()) {
+      const auto description_size =
+          static_cast<uint64_t>(stored_entry.description.size());
+      entry_file.write(cache_entry_magic, sizeof(cache_entry_magic));
+      entry_file.write(reinterpret_cast<const char*>(&description_size),
+                       sizeof(description_size));
+      entry_file << stored_entry.description;
+      if (out_file.peek() != std::ifstream::traits_type::eof()) {
+        entry_file << out_file.rdbuf();
+      }
+      entry_file.close();
+      stored = static_cast<bool>(entry_file);
+    }
+  }
+  if (not stored or
+      std::rename(temporary_path.c_str(),
+                  (cache_dir + "/" + stored_entry.name).c_str()) != 0) {
+    std::remove(temporary_path.c_str());
+    std::cerr << "Could not store output in cache directory: " << cache_dir
+              << "\n";
+    return;
+  }
+
+  std::vector<std::tuple<time_t, size_t, std::string>> entries{};
+  size_t cache_bytes = 0;
+  DIR* const directory = ::opendir(cache_dir.c_str());
+  if (directory == nullptr) {
+    return;
+  }
+  while (const dirent* const entry = ::readdir(directory)) {
+    const std::string name = entry->d_name;
+    const std::string suffix = ".folded";
+    if (name.size() <= suffix.size() or
+        name.compare(name.size() - suffix.size(), suffix.size(), suffix) !=
+            0) {
+      continue;
+    }
+    struct stat entry_stat {};
+    if (::stat((cache_dir + "/" + name).c_str(), &entry_stat) == 0) {
+      entries.emplace_back(entry_stat.st_mtime,
+                           static_cast<size_t>(entry_stat.st_size), name);
+      cache_bytes += static_cast<size_t>(entry_stat.st_size);
+    }
+  }
+  ::closedir(directory);
+  std::sort(entries.begin(), entries.end());
+  for (const auto& entry : entries) {
+    if (cache_bytes <= max_cache_bytes) {
+      break;
+    }
+    if (std::get<2>(entry) != stored_entry.name) {
+      std::remove((cache_dir + "/" + std::get<2>(entry)).c_str());
+      cache_bytes -= std::get<1>(entry);
+    }
+  }
+}
+
+/*!
+ * \brief Returns the lowest stack frame. Specifically, if the sample is
+ * collected in: `main()->foo()->bar()->baz()` it will return `baz`
+ */
+std::string get_lowest_stack(const std::string& full_stack_and_sample_count) {
+  const auto location_of_last_semicolon =
+      full_stack_and_sample_count.find_last_of(';') + 1;
+  return full_stack_and_sample_count.substr(
+      location_of_last_semicolon,
+      full_stack_and_sample_count.find_last_of(' ') -
+          location_of_last_semicolon);
+}
+
+/*!
+ * \brief Returns the number of samples collected for the specific stack trace,
+ * which may be any 64-bit or fractional weight such as nanoseconds or bytes
+ */
+double get_sample_count(const std::string& full_stack_and_sample_count) {
+  return std::strtod(full_stack_and_sample_count.c_str() +
+                         full_stack_and_sample_count.find_last_of(' ') + 1,
+                     nullptr);
+}
+
+/*!
+ * \brief Returns the number of bytes `str` holds on the heap, which is zero if
+ * the string fits in the small string buffer
+ */
+size_t heap_bytes(const std::string& str) {
+  static const size_t small_string_capacity = std::string{}.capacity();
+  return str.capacity() > small_string_capacity ? str.capacity() + 1 : 0;
+}
+
+/*!
+ * \brief Walks the map returned by `build_stack_map` and prints how many bytes
+ * are used by the line text, the frame strings used as keys, the map nodes,
+ * and the vectors of lines, as well as their ratio to the input file size.
+ *
+ * The map node overhead is estimated as four pointers per node (parent, left,
+ * right, and color), which is what the common standard libraries use.
+ */
+void print_memory_report(
+    std::ostream& os,
+    const std::map<std::string, std::tuple<double, std::vector<std::string>>>&
+        stack_map,
+    const size_t input_bytes) {
+  using MapType = std::decay<decltype(stack_map)>::type;
+  size_t line_bytes = 0;
+  size_t number_of_lines = 0;
+  size_t frame_bytes = 0;
+  size_t vector_bytes = 0;
+  const size_t map_node_bytes =
+      stack_map.size() * (sizeof(MapType::value_type) + 4 * sizeof(void*));
+  for (const auto& lowest_frame_and_stacks : stack_map) {
+    frame_bytes += heap_bytes(lowest_frame_and_stacks.first);
+    const auto& lines = std::get<1>(lowest_frame_and_stacks.second);
+    vector_bytes += lines.capacity() * sizeof(std::string);
+    number_of_lines += lines.size();
+    for (const auto& line : lines) {
+      line_bytes += heap_bytes(line);
+    }
+  }
+  const size_t total_bytes =
+      line_bytes + frame_bytes + map_node_bytes + vector_bytes;
+
+  const auto print_row = [&os, &input_bytes](const char* const category,
+                                             const size_t count,
+                                             const size_t bytes) {
+    char buffer[128];
+    std::snprintf(buffer, sizeof(buffer), "%-14s %12zu %16zu %12.3f\n",
+                  category, count, bytes,
+                  input_bytes == 0 ? 0.0
+                                   : static_cast<double>(bytes) /
+                                         static_cast<double>(input_bytes));
+    os << buffer;
+  };
+  char buffer[128];
+  std::snprintf(buffer, sizeof(buffer), "%-14s %12s %16s %12s\n", "category",
+                "count", "bytes", "x input");
+  os << buffer;
+  print_row("line text", number_of_lines, line_bytes);
+  print_row("frame strings", stack_map.size(), frame_bytes);
+  print_row("map nodes", stack_map.size(), map_node_bytes);
+  print_row("line vectors", stack_map.size(), vector_bytes);
+  print_row("total", number_of_lines, total_bytes);
+  std::snprintf(buffer, sizeof(buffer), "%-14s %12s %16zu\n", "input file",
+                "", input_bytes);
+  os << buffer;
+}
+
+/*!
+ * \brief Returns the offset in `line` of the lowest `stack_limit` frames. That
+ * is, for main()->foo()->bar()->baz() with a limit of two main() and foo()
+ * are skipped.
+ */
+size_t stack_limit_offset(const std::string& line, const size_t stack_limit) {
+  if (stack_limit == 0) {
+    return 0;
+  }
+  typename std::string::size_type current_position = line.size();
+  for (size_t i = 0;
+       i < stack_limit and current_position != std::string::npos; ++i) {
+    current_position = line.rfind(';', current_position - 1);
+  }
+  return current_position != std::string::npos ? current_position + 1 : 0;
+}
+
+/*!
+ * \brief Writes the stacks of the map returned by `build_stack_map` that have a
+ * percentage of the total samples greater than the cutoff percentage and are
+ * in the list of functions to show, if any are given, keeping only the lowest
+ * `stack_limit` frames of each if it is non-zero.
+ *
+ * The filter, stack limit, and write stages are fused into one pass over the
+ * map, so no filtered or shortened copy of the lines is made.
+ */
+void write_filtered_stack_map(
+    const std::map<std::string, std::tuple<double, std::vector<std::string>>>&
+        stack_map,
+    const double cutoff_percentage,
+    const std::vector<std::string>& regexes_to_show, const size_t stack_limit,
+    const std::string& out_filename) {
+  const double total_samples = std::accumulate(
+      stack_map.begin(), stack_map.end(), 0.0,
+      [](const double state,
+         const std::pair<const std::string,
+                         std::tuple<double, std::vector<std::string>>>&
+             element) { return state + std::get<0>(element.second); });
+  const std::vector<std::regex> expressions(regexes_to_show.begin(),
+                                            regexes_to_show.end());
+  std::ofstream out_file(out_filename);
+  if (not out_file.is_open()) {
+    throw std::runtime_error("Could not open file: " + out_filename +
+                             " for writing");
+  }
+  for (const auto& lowest_frame_and_stacks : stack_map) {
+    const auto& lowest_frame = lowest_frame_and_stacks.first;
+    if (not(std::get<0>(lowest_frame_and_stacks.second) / total_samples >
+            0.01 * cutoff_percentage) or
+        (not expressions.empty() and
+         std::none_of(expressions.begin(), expressions.end(),
+                      [&lowest_frame](const std::regex& expression) {
+                        return std::regex_match(lowest_frame, expression);
+                      }))) {
+      continue;
+    }
+    for (const auto& line : std::get<1>(lowest_frame_and_stacks.second)) {
+      const size_t offset = stack_limit_offset(line, stack_limit);
+      out_file.write(line.data() + offset,
+                     static_cast<std::streamsize>(line.size() - offset));
+      out_file << '\n';
+    }
+  }
+  out_file.close();
+  if (not out_file) {
+    throw std::runtime_error("Could not write file: " + out_filename);
+  }
+}
+
+/*!
+ * \brief An array that either owns its elements or refers to read-only
+ * elements owned elsewhere, such as a memory mapped index or shared memory
+ * segment.
+ *
+ * Modifying an array that refers to external memory first copies the elements,
+ * so a profile can be used straight from a mapping and still be extended.
+ */
+template <class T>
+class SharedArray {
+ public:
+  SharedArray() = default;
+  SharedArray(std::initializer_list<T> values) : owned_(values) {}
+
+  /// An array referring to `size` elements at `data`, which must outlive it
+  static SharedArray view(const T* const data, const size_t size) {
+    SharedArray array{};
+    array.external_ = data;
+    array.external_size_ = size;
+    return array;
+  }
+
+  size_t size() const {
+    return external_ != nullptr ? external_size_ : owned_.size();
+  }
+  bool empty() const { return size() == 0; }
+  size_t capacity() const {
+    return external_ != nullptr ? external_size_ : owned_.capacity();
+  }
+  bool is_view() const { return external_ != nullptr; }
+
+  const T* data() const {
+    return external_ != nullptr ? external_ : owned_.data();
+  }
+  const T* begin() const { return data(); }
+  const T* end() const { return data() + size(); }
+  const T& operator[](const size_t i) const { return data()[i]; }
+  const T& back() const { return data()[size() - 1]; }
+
+  T* begin() { return owned().data(); }
+  T* end() { return owned().data() + owned().size(); }
+  T& operator[](const size_t i) { return owned()[i]; }
+
+  void push_back(const T& value) { owned().push_back(value); }
+  template <class Iterator>
+  void append(Iterator first, Iterator last) {
+    owned().insert(owned().end(), first, last);
+  }
+  void resize(const size_t size, const T& value = T{}) {
+    owned().resize(size, value);
+  }
+  void reserve(const size_t size) { owned().reserve(size); }
+  void clear() {
+    external_ = nullptr;
+    external_size_ = 0;
+    owned_.clear();
+  }
+
+ private:
+  std::vector<T>& owned() {
+    if (external_ != nullptr) {
+      owned_.assign(external_, external_ + external_size_);
+      external_ = nullptr;
+      external_size_ = 0;
+    }
+    return owned_;
+  }
+
+  std::vector<T> owned_{};
+  const T* external_ = nullptr;
+  size_t external_size_ = 0;
+};
+
+/*!
+ * \brief The name of a frame in a `FrameDictionary`, which stays valid until a
+ * frame is added to the dictionary
+ */
+class FrameName {
+ public:
+  FrameName(const char* const data, const size_t size)
+      : data_(data), size_(size) {}
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  const char* begin() const { return data_; }
+  const char* end() const { return data_ + size_; }
+
+  std::string str() const { return std::string(data_, size_); }
+  operator std::string() const { return str(); }
+
+  /// Compares like `std::string`, i.e. bytes as unsigned characters
+  int compare(const FrameName& other) const {
+    const size_t common = std::min(size_, other.size_);
+    const int result =
+        common == 0
+            ? 0
+            : std::char_traits<char>::compare(data_, other.data_, common);
+    if (result != 0) {
+      return result;
+    }
+    return size_ < other.size_ ? -1 : (size_ > other.size_ ? 1 : 0);
+  }
+
+ private:
+  const char* data_;
+  size_t size_;
+};
+
+inline bool operator==(const FrameName& lhs, const FrameName& rhs) {
+  return lhs.compare(rhs) == 0;
+}
+
+inline bool operator!=(const FrameName& lhs, const FrameName& rhs) {
+  return lhs.compare(rhs) != 0;
+}
+
+inline bool operator<(const FrameName& lhs, const FrameName& rhs) {
+  return lhs.compare(rhs) < 0;
+}
+
+inline bool operator<=(const FrameName& lhs, const FrameName& rhs) {
+  return lhs.compare(rhs) <= 0;
+}
+
+std::ostream& operator<<(std::ostream& os, const FrameName& name) {
+  return os.write(name.data(), static_cast<std::streamsize>(name.size()));
+}
+
+/*!
+ * \brief The distinct frame names of a profile, stored back to back in one
+ * character array so that a mapped index or shared memory segment can be used
+ * without copying the names.
+ */
+struct FrameDictionary {
+  /// Frame `i` is `characters[name_offsets[i]]` up to (excluding)
+  /// `characters[name_offsets[i + 1]]`
+  SharedArray<uint64_t> name_offsets{0};
+  SharedArray<char> characters{};
+
+  size_t size() const { return name_offsets.size() - 1; }
+  bool empty() const { return size() == 0; }
+
+  FrameName operator[](const size_t frame_id) const {
+    const uint64_t begin = name_offsets[frame_id];
+    return FrameName(characters.data() + begin,
+                     static_cast<size_t>(name_offsets[frame_id + 1] - begin));
+  }
+
+  void push_back(const std::string& name) {
+    characters.append(name.begin(), name.end());
+    name_offsets.push_back(characters.size());
+  }
+};
+
+/*!
+ * \brief A folded profile with every distinct frame name stored once.
+ *
+ * Frames are referred to by their index into `frames` and each distinct stack
+ * is stored as a contiguous range of frame IDs in `stack_frames`, ordered from
+ * the root to the lowest frame, with its sample count in `sample_counts`.
+ *
+ * Inputs with several value columns per line, e.g. cycles and instructions,
+ * have one metric per column. The first metric is the one that is filtered
+ * and written and is stored in `sample_counts`, the others in
+ * `other_metric_values`. Values are doubles so that weights such as
+ * nanoseconds or bytes may be fractional.
+ */
+struct FoldedProfile {
+  FrameDictionary frames{};
+  /// Frame name to its ID. Not stored in the index, rebuilt the first time a
+  /// frame is interned into a loaded profile.
+  std::unordered_map<std::string, uint32_t> frame_ids{};
+  /// Stack `i` is `stack_frames[stack_offsets[i]]` up to (excluding)
+  /// `stack_frames[stack_offsets[i + 1]]`
+  SharedArray<uint64_t> stack_offsets{0};
+  SharedArray<uint32_t> stack_frames{};
+  SharedArray<double> sample_counts{};
+  /// The name of each metric, i.e. value column of the folded lines
+  std::vector<std::string> metric_names{"samples"};
+  /// The values of metric `m` are `other_metric_values[m - 1]`
+  std::vector<SharedArray<double>> other_metric_values{};
+  /// Hash of the frame IDs of each stack to the stacks with that hash, used to
+  /// merge identical stacks. Not stored in the index, rebuilt the first time a
+  /// stack is added to a loaded profile.
+  std::unordered_multimap<uint64_t, uint32_t> stack_lookup{};
+
+  size_t number_of_stacks() const { return sample_counts.size(); }
+
+  const uint32_t* stack_begin(const size_t stack_id) const {
+    return stack_frames.data() + stack_offsets[stack_id];
+  }
+
+  const uint32_t* stack_end(const size_t stack_id) const {
+    return stack_frames.data() + stack_offsets[stack_id + 1];
+  }
+
+  uint32_t lowest_frame(const size_t stack_id) const {
+    return *(stack_end(stack_id) - 1);
+  }
+
+  size_t number_of_metrics() const { return metric_names.size(); }
+
+  const SharedArray<double>& metric_values(const size_t metric) const {
+    return metric == 0 ? sample_counts : other_metric_values[metric - 1];
+  }
+
+  SharedArray<double>& metric_values(const size_t metric) {
+    return metric == 0 ? sample_counts : other_metric_values[metric - 1];
+  }
+};
+
+/*!
+ * \brief Sets the names of the metrics of a profile that has no stacks yet
+ */
+void set_metric_names(FoldedProfile& profile,
+                      const std::vector<std::string>& metric_names) {
+  if (metric_names.empty()) {
+    throw std::invalid_argument("A profile needs at least one metric");
+  }
+  profile.metric_names = metric_names;
+  profile.other_metric_values.assign(metric_names.size() - 1,
+                                     SharedArray<double>{});
+}
+
+/*!
+ * \brief Returns the index of the metric called `name`, throwing if the
+ * profile has no such metric
+ */
+size_t find_metric(const FoldedProfile& profile, const std::string& name) {
+  const auto it = std::find(profile.metric_names.begin(),
+                            profile.metric_names.end(), name);
+  if (it == profile.metric_names.end()) {
+    throw std::invalid_argument("The profile has no metric '" + name + "'");
+  }
+  return static_cast<size_t>(it - profile.metric_names.begin());
+}
+
+/*!
+ * \brief Moves `metric` to the front of the metrics of the profile so that it
+ * is filtered and written, and returns whether the first metric has changed.
+ *
+ * For a ratio of two metrics, `A/B`, metric `B` is moved to the front and is
+ * used for the cutoff, and `ratio_metric` is set to the index of `A`, so that
+ * the value of each written line is the ratio of `A` to `B` summed over the
+ * stacks it contains. Otherwise `ratio_metric` is set to zero.
+ */
+bool select_metric(FoldedProfile& profile, const std::string& metric,
+                   size_t& ratio_metric) {
+  const auto separator = metric.find('/');
+  const size_t selected = find_metric(
+      profile,
+      separator == std::string::npos ? metric : metric.substr(separator + 1));
+  ratio_metric = separator == std::string::npos
+                     ? 0
+                     : find_metric(profile, metric.substr(0, separator));
+  if (separator != std::string::npos and ratio_metric == selected) {
+    throw std::invalid_argument("The ratio " + metric +
+                                " needs two different metrics");
+  }
+  if (selected == 0) {
+    return false;
+  }
+  std::swap(profile.sample_counts, profile.other_metric_values[selected - 1]);
+  std::swap(profile.metric_names[0], profile.metric_names[selected]);
+  if (separator != std::string::npos and ratio_metric == 0) {
+    ratio_metric = selected;
+  }
+  return true;
+}
+
+/*!
+ * \brief Returns the ID of `frame`, adding it to the dictionary if necessary
+ */
+uint32_t intern_frame(FoldedProfile& profile, const std::string& frame) {
+  if (profile.frame_ids.size() != profile.frames.size()) {
+    profile.frame_ids.clear();
+    profile.frame_ids.reserve(profile.frames.size());
+    for (size_t i = 0; i < profile.frames.size(); ++i) {
+      profile.frame_ids.emplace(profile.frames[i].str(),
+                                static_cast<uint32_t>(i));
+    }
+  }
+  const auto it = profile.frame_ids.find(frame);
+  if (it != profile.frame_ids.end()) {
+    return it->second;
+  }
+  const auto frame_id = static_cast<uint32_t>(profile.frames.size());
+  profile.frames.push_back(frame);
+  profile.frame_ids.emplace(frame, frame_id);
+  return frame_id;
+}
+
+/*!
+ * \brief Returns the hash used to look up identical stacks
+ */
+uint64_t hash_stack(const uint32_t* const begin, const uint32_t* const end) {
+  return hash_bytes(reinterpret_cast<const char*>(begin),
+                    static_cast<size_t>(end - begin) * sizeof(uint32_t));
+}
+
+/*!
+ * \brief Rebuilds the lookup table of identical stacks
+ */
+void rebuild_stack_lookup(FoldedProfile& profile) {
+  profile.stack_lookup.clear();
+  profile.stack_lookup.reserve(profile.number_of_stacks());
+  for (size_t i = 0; i < profile.number_of_stacks(); ++i) {
+    profile.stack_lookup.emplace(
+        hash_stack(profile.stack_begin(i), profile.stack_end(i)),
+        static_cast<uint32_t>(i));
+  }
+}
+
+/*!
+ * \brief Adds `values`, one per metric, to the stack made of the frame IDs
+ * `[begin, end)`, appending the stack if it has not been seen before
+ */
+void add_stack(FoldedProfile& profile, const uint32_t* const begin,
+               const uint32_t* const end, const double* const values) {
+  if (profile.stack_lookup.size() != profile.number_of_stacks()) {
+    rebuild_stack_lookup(profile);
+  }
+  const uint64_t hash = hash_stack(begin, end);
+  const auto candidates = profile.stack_lookup.equal_range(hash);
+  for (auto it = candidates.first; it != candidates.second; ++it) {
+    if (end - begin ==
+            profile.stack_end(it->second) - profile.stack_begin(it->second) and
+        std::equal(begin, end, profile.stack_begin(it->second))) {
+      for (size_t metric = 0; metric < profile.number_of_metrics(); ++metric) {
+        profile.metric_values(metric)[it->second] += values[metric];
+      }
+      return;
+    }
+  }
+  const auto stack_id = static_cast<uint32_t>(profile.number_of_stacks());
+  profile.stack_frames.append(begin, end);
+  profile.stack_offsets.push_back(profile.stack_frames.size());
+  for (size_t metric = 0; metric < profile.number_of_metrics(); ++metric) {
+    profile.metric_values(metric).push_back(values[metric]);
+  }
+  profile.stack_lookup.emplace(hash, stack_id);
+}
+
+/*!
+ * \brief Adds a single folded line, `frame;frame;frame count`, to the profile.
+ * A profile with several metrics expects one space separated value per metric
+ * after the stack. Lines without enough values are ignored.
+ */
+void add_folded_line(FoldedProfile& profile, const std::string& line,
+                     std::vector<uint32_t>& frame_id_buffer,
+                     std::vector<double>& value_buffer) {
+  value_buffer.resize(profile.number_of_metrics());
+  size_t location_of_last_space = line.size();
+  for (size_t metric = value_buffer.size(); metric-- > 0;) {
+    location_of_last_space =
+        location_of_last_space == 0
+            ? std::string::npos
+            : line.find_last_of(' ', location_of_last_space - 1);
+    if (location_of_last_space == std::string::npos) {
+      return;
+    }
+    value_buffer[metric] =
+        std::strtod(line.c_str() + location_of_last_space + 1, nullptr);
+  }
+  frame_id_buffer.clear();
+  std::string frame{};
+  size_t frame_start = 0;
+  while (frame_start <= location_of_last_space) {
+    size_t frame_end = line.find(';', frame_start);
+    if (frame_end == std::string::npos or frame_end > location_of_last_space) {
+      frame_end = location_of_last_space;
+    }
+    frame.assign(line, frame_start, frame_end - frame_start);
+    frame_id_buffer.push_back(intern_frame(profile, frame));
+    frame_start = frame_end + 1;
+  }
+  add_stack(profile, frame_id_buffer.data(),
+            frame_id_buffer.data() + frame_id_buffer.size(),
+            value_buffer.data());
+}
+
+/*!
+ * \brief Reads a byte range of a file in large blocks with many reads in
+ * flight, using Linux io_uring
+ *
+ * `next()` returns the blocks in file order. While the caller parses one block
+ * the reads of the following blocks are already queued, so files that are not
+ * in the page cache are read at the bandwidth of the storage instead of one
+ * request at a time. Without io_uring (not Linux, kernel headers without
+ * `IORING_OP_READ`, an old kernel, or a seccomp policy that forbids it) each
+ * block is read with `pread` when it is needed.
+ */
+class BlockReader {
+ public:
+  static constexpr size_t block_size = size_t{1} << 20;
+  static constexpr size_t queue_depth = 32;
+
+  BlockReader(const int file_descriptor, const size_t begin, const size_t end)
+      : file_descriptor_(file_descriptor),
+        begin_(begin),
+        number_of_blocks_(end > begin ? (end - begin - 1) / block_size + 1 : 0),
+        end_(end) {
+#ifdef FLAMEGRAPH_FILTER_USE_IO_URING
+    const size_t slots = std::min(queue_depth, number_of_blocks_);
+    if (slots > 1 and setup_ring(static_cast<unsigned>(slots))) {
+      slots_ = slots;
+      completed_.assign(slots_, 0);
+      results_.assign(slots_, 0);
+      buffer_.resize(slots_ * block_size);
+      for (size_t block = 0; block < slots_; ++block) {
+        submit(block);
+      }
+      return;
+    }
+#endif
+#ifdef POSIX_FADV_SEQUENTIAL
+    ::posix_fadvise(file_descriptor_, static_cast<off_t>(begin_),
+                    static_cast<off_t>(end_ - begin_), POSIX_FADV_SEQUENTIAL);
+#endif
+    buffer_.resize(std::min(block_size, end_ - std::min(begin_, end_)));
+  }
+
+  BlockReader(const BlockReader&) = delete;
+  BlockReader& operator=(const BlockReader&) = delete;
+
+  ~BlockReader() {
+#ifdef FLAMEGRAPH_FILTER_USE_IO_URING
+    if (uses_io_uring()) {
+      // The kernel writes into `buffer_` until every read has completed
+      while (in_flight_ > 0) {
+        wait_for_completions();
+      }
+      ::munmap(submission_entries_, submission_entries_size_);
+      if (completion_ring_ != submission_ring_) {
+        ::munmap(completion_ring_, completion_ring_size_);
+      }
+      ::munmap(submission_ring_, submission_ring_size_);
+      ::close(ring_file_descriptor_);
+    }
+#endif
+  }
+
+  bool uses_io_uring() const { return ring_file_descriptor_ >= 0; }
+
+  /// Points `data` at the next block and sets `size` to its length. Returns
+  /// false at the end of the range. The block stays valid until the next call.
+  bool next(const char*& data, size_t& size) {
+#ifdef FLAMEGRAPH_FILTER_USE_IO_URING
+    if (uses_io_uring() and next_block_ > 0 and
+        next_block_ - 1 + slots_ < number_of_blocks_) {
+      // The previous block has been consumed, so its buffer can be refilled
+      submit(next_block_ - 1 + slots_);
+    }
+#endif
+    if (next_block_ >= number_of_blocks_) {
+      return false;
+    }
+    const size_t block = next_block_++;
+    const size_t offset = begin_ + block * block_size;
+    const size_t length = std::min(block_size, end_ - offset);
+    char* const buffer = &buffer_[(block % slots_) * block_size];
+    size_t bytes_read = 0;
+#ifdef FLAMEGRAPH_FILTER_USE_IO_URING
+    if (uses_io_uring()) {
+      const size_t slot = block % slots_;
+      while (not completed_[slot]) {
+        wait_for_completions();
+      }
+      completed_[slot] = 0;
+      // Failed reads, e.g. on kernels without IORING_OP_READ, and short reads
+      // are finished with pread below
+      bytes_read = results_[slot] > 0 ? static_cast<size_t>(results_[slot]) : 0;
+    }
+#endif
+    while (bytes_read < length) {
+      const ssize_t result =
+          ::pread(file_descriptor_, buffer + bytes_read, length - bytes_read,
+                  static_cast<off_t>(offset + bytes_read));
+      if (result < 0 and errno == EINTR) {
+        continue;
+      }
+      if (result < 0) {
+        std::cerr << "Failed to read input: " << std::strerror(errno) << "\n";
+        std::exit(1);
+      }
+      if (result == 0) {
+        // The file was truncated while reading it
+        number_of_blocks_ = next_block_;
+        break;
+      }
+      bytes_read += static_cast<size_t>(result);
+    }
+    data = buffer;
+    size = bytes_read;
+    return true;
+  }
+
+ private:
+#ifdef FLAMEGRAPH_FILTER_USE_IO_URING
+  bool setup_ring(const unsigned entries) {
+    io_uring_params parameters{};
+    const int ring_file_descriptor =
+        static_cast<int>(syscall(__NR_io_uring_setup, entries, &parameters));
+    if (ring_file_descriptor < 0) {
+      return false;
+    }
+    submission_ring_size_ =
+        parameters.sq_off.array + parameters.sq_entries * sizeof(unsigned);
+    completion_ring_size_ = parameters.cq_off.cqes +
+                            parameters.cq_entries * sizeof(io_uring_cqe);
+    const bool single_mapping =
+        (parameters.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mapping) {
+      submission_ring_size_ =
+          std::max(submission_ring_size_, completion_ring_size_);
+      completion_ring_size_ = submission_ring_size_;
+    }
+    const auto map_ring = [ring_file_descriptor](const size_t size,
+                                                 const off_t offset) {
+      return ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_file_descriptor, offset);
+    };
+    submission_ring_ = map_ring(submission_ring_size_, IORING_OFF_SQ_RING);
+    completion_ring_ =
+        single_mapping ? submission_ring_
+                       : map_ring(completion_ring_size_, IORING_OFF_CQ_RING);
+    submission_entries_size_ = parameters.sq_entries * sizeof(io_uring_sqe);
+    submission_entries_ =
+        map_ring(submission_entries_size_, IORING_OFF_SQES);
+    if (submission_ring_ == MAP_FAILED or completion_ring_ == MAP_FAILED or
+        submission_entries_ == MAP_FAILED) {
+      if (submission_entries_ != MAP_FAILED) {
+        ::munmap(submission_entries_, submission_entries_size_);
+      }
+      if (not single_mapping and completion_ring_ != MAP_FAILED) {
+        ::munmap(completion_ring_, completion_ring_size_);
+      }
+      if (submission_ring_ != MAP_FAILED) {
+        ::munmap(submission_ring_, submission_ring_size_);
+      }
+      ::close(ring_file_descriptor);
+      return false;
+    }
+    char* const submission_ring = static_cast<char*>(submission_ring_);
+    char* const completion_ring = static_cast<char*>(completion_ring_);
+    submission_tail_ =
+        reinterpret_cast<unsigned*>(submission_ring + parameters.sq_off.tail);
+    submission_mask_ = reinterpret_cast<unsigned*>(
+        submission_ring + parameters.sq_off.ring_mask);
+    submission_array_ =
+        reinterpret_cast<unsigned*>(submission_ring + parameters.sq_off.array);
+    completion_head_ =
+        reinterpret_cast<unsigned*>(completion_ring + parameters.cq_off.head);
+    completion_tail_ =
+        reinterpret_cast<unsigned*>(completion_ring + parameters.cq_off.tail);
+    completion_mask_ = reinterpret_cast<unsigned*>(
+        completion_ring + parameters.cq_off.ring_mask);
+    completions_ = reinterpret_cast<io_uring_cqe*>(completion_ring +
+                                                   parameters.cq_off.cqes);
+    ring_file_descriptor_ = ring_file_descriptor;
+    return true;
+  }
+
+  /// Queues the read of `block` into its buffer. It is handed to the kernel
+  /// by the next `wait_for_completions()`.
+  void submit(const size_t block) {
+    const size_t offset = begin_ + block * block_size;
+    const unsigned tail = *submission_tail_;
+    const unsigned index = tail & *submission_mask_;
+    io_uring_sqe& entry =
+        static_cast<io_uring_sqe*>(submission_entries_)[index];
+    std::memset(&entry, 0, sizeof(entry));
+    entry.opcode = IORING_OP_READ;
+    entry.fd = file_descriptor_;
+    entry.addr = reinterpret_cast<uint64_t>(
+        &buffer_[(block % slots_) * block_size]);
+    entry.len = static_cast<uint32_t>(std::min(block_size, end_ - offset));
+    entry.off = offset;
+    entry.user_data = block;
+    submission_array_[index] = index;
+    __atomic_store_n(submission_tail_, tail + 1, __ATOMIC_RELEASE);
+    ++unsubmitted_;
+    ++in_flight_;
+  }
+
+  /// Submits the queued reads and waits until at least one read has completed
+  void wait_for_completions() {
+    unsigned head = *completion_head_;
+    if (head == __atomic_load_n(completion_tail_, __ATOMIC_ACQUIRE)) {
+      const long submitted =
+          syscall(__NR_io_uring_enter, ring_file_descriptor_, unsubmitted_, 1,
+                  IORING_ENTER_GETEVENTS, nullptr, 0);
+      if (submitted < 0 and errno != EINTR and errno != EAGAIN and
+          errno != EBUSY) {
+        std::cerr << "Failed to submit reads: " << std::strerror(errno)
+                  << "\n";
+        std::exit(1);
+      }
+      if (submitted > 0) {
+        unsubmitted_ -= static_cast<unsigned>(submitted);
+      }
+    }
+    const unsigned tail = __atomic_load_n(completion_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+      const io_uring_cqe& completion = completions_[head & *completion_mask_];
+      const size_t slot = static_cast<size_t>(completion.user_data) % slots_;
+      results_[slot] = completion.res;
+      completed_[slot] = 1;
+      --in_flight_;
+    }
+    __atomic_store_n(completion_head_, head, __ATOMIC_RELEASE);
+  }
+#endif
+
+  int file_descriptor_;
+  size_t begin_;
+  size_t number_of_blocks_;
+  size_t end_;
+  size_t next_block_ = 0;
+  size_t slots_ = 1;
+  std::vector<char> buffer_{};
+  std::vector<char> completed_{};
+  std::vector<int32_t> results_{};
+  int ring_file_descriptor_ = -1;
+#ifdef FLAMEGRAPH_FILTER_USE_IO_URING
+  void* submission_ring_ = MAP_FAILED;
+  void* completion_ring_ = MAP_FAILED;
+  void* submission_entries_ = MAP_FAILED;
+  size_t submission_ring_size_ = 0;
+  size_t completion_ring_size_ = 0;
+  size_t submission_entries_size_ = 0;
+  unsigned* submission_tail_ = nullptr;
+  unsigned* submission_mask_ = nullptr;
+  unsigned* submission_array_ = nullptr;
+  unsigned* completion_head_ = nullptr;
+  unsigned* completion_tail_ = nullptr;
+  unsigned* completion_mask_ = nullptr;
+  io_uring_cqe* completions_ = nullptr;
+  unsigned unsubmitted_ = 0;
+  size_t in_flight_ = 0;
+#endif
+};
+
+constexpr size_t BlockReader::block_size;
+constexpr size_t BlockReader::queue_depth;
+
+/*!
+ * \brief Builds a map between the lowest stack frame and a pair of the total
+ * samples of that lowest stack frame and a vector of the stack trace
+ */
+std::map<std::string, std::tuple<double, std::vector<std::string>>>
+build_stack_map(const std::string& filename) {
+  const int file_descriptor = ::open(filename.c_str(), O_RDONLY);
+  struct stat file_stat {};
+  if (file_descriptor < 0 or ::fstat(file_descriptor, &file_stat) != 0) {
+    std::cerr << "Could not open file: " << filename << " for reading\n";
+    std::exit(1);
+  }
+  std::map<std::string, std::tuple<double, std::vector<std::string>>>
+      stack_map{};
+  const auto add_line = [&stack_map](const std::string& line) {
+    const std::string lowest_stack = get_lowest_stack(line);
+    if (stack_map.find(lowest_stack) != stack_map.end()) {
+      auto& current_stack = stack_map[lowest_stack];
+      std::get<0>(current_stack) += get_sample_count(line);
+      std::get<1>(current_stack).push_back(line);
+    } else {
+      stack_map[lowest_stack] = std::tuple<double, std::vector<std::string>>{
+          get_sample_count(line), std::vector<std::string>{line}};
+    }
+  };
+  std::string line;
+  size_t bytes_read = 0;
+  {
+    BlockReader reader{file_descriptor, 0,
+                       static_cast<size_t>(file_stat.st_size)};
+    const char* block = nullptr;
+    size_t size = 0;
+    while (reader.next(block, size)) {
+      const char* const block_end = block + size;
+      const char* line_begin = block;
+      const char* line_end = nullptr;
+      while ((line_end = static_cast<const char*>(std::memchr(
+                  line_begin, '\n',
+                  static_cast<size_t>(block_end - line_begin)))) != nullptr) {
+        // `line` may hold the start of the line from the previous block
+        line.append(line_begin, line_end);
+        add_line(line);
+        line.clear();
+        line_begin = line_end + 1;
+      }
+      line.append(line_begin, block_end);
+      bytes_read += size;
+      progress::bytes_processed->store(bytes_read, std::memory_order_relaxed);
+    }
+  }
+  if (not line.empty()) {
+    add_line(line);
+  }
+  ::close(file_descriptor);
+  return stack_map;
+}
+
+/*!
+ * \brief Parses the folded file from byte `offset`, which must be the start of
+ * a line, up to byte `end` or the end of the file into `profile`
+ */
+void parse_folded_file(FoldedProfile& profile, const std::string& filename,
+                       const size_t offset = 0,
+                       const size_t end = std::numeric_limits<size_t>::max()) {
+  const int file_descriptor = ::open(filename.c_str(), O_RDONLY);
+  struct stat file_stat {};
+  if (file_descriptor < 0 or ::fstat(file_descriptor, &file_stat) != 0) {
+    std::cerr << "Could not open file: " << filename << " for reading\n";
+    std::exit(1);
+  }
+  std::string line;
+  std::vector<uint32_t> frame_id_buffer{};
+  std::vector<double> value_buffer{};
+  // Several files may be parsed one after the other, so the progress is
+  // added to rather than set
+  progress::bytes_processed->fetch_add(offset, std::memory_order_relaxed);
+  {
+    BlockReader reader{file_descriptor, offset,
+                       std::min(end, static_cast<size_t>(file_stat.st_size))};
+    const char* block = nullptr;
+    size_t size = 0;
+    while (reader.next(block, size)) {
+      const char* const block_end = block + size;
+      const char* line_begin = block;
+      const char* line_end = nullptr;
+      while ((line_end = static_cast<const char*>(std::memchr(
+                  line_begin, '\n',
+                  static_cast<size_t>(block_end - line_begin)))) != nullptr) {
+        // `line` may hold the start of the line from the previous block
+        line.append(line_begin, line_end);
+        add_folded_line(profile, line, frame_id_buffer, value_buffer);
+        line.clear();
+        line_begin = line_end + 1;
+      }
+      line.append(line_begin, block_end);
+      progress::bytes_processed->fetch_add(size, std::memory_order_relaxed);
+    }
+  }
+  if (not line.empty()) {
+    add_folded_line(profile, line, frame_id_buffer, value_buffer);
+  }
+  ::close(file_descriptor);
+}
+
+/*!
+ * \brief An inverted index from each frame ID to the sorted IDs of the stacks
+ * that contain the frame at any depth.
+ *
+ * Each posting list is stored as the differences between consecutive stack
+ * IDs, encoded as LEB128 variable length integers, so that frames appearing in
+ * many stacks usually take one byte per stack.
+ */
+struct FrameIndex {
+  /// The postings of frame `i` are `postings[posting_offsets[i]]` up to
+  /// (excluding) `postings[posting_offsets[i + 1]]`
+  SharedArray<uint64_t> posting_offsets{0};
+  SharedArray<uint8_t> postings{};
+};
+
+/*!
+ * \brief Appends `delta` to the postings as a LEB128 variable length integer
+ */
+void append_posting(std::vector<uint8_t>& postings, uint32_t delta) {
+  while (delta >= 0x80) {
+    postings.push_back(static_cast<uint8_t>(delta | 0x80));
+    delta >>= 7;
+  }
+  postings.push_back(static_cast<uint8_t>(delta));
+}
+
+/*!
+ * \brief Builds the inverted index from frame IDs to stack IDs of the profile
+ */
+FrameIndex build_frame_index(const FoldedProfile& profile) {
+  std::vector<std::vector<uint8_t>> postings_by_frame(profile.frames.size());
+  // The last stack added to each frame's postings, offset by one so that zero
+  // means none
+  std::vector<uint32_t> last_stack(profile.frames.size(), 0);
+  for (size_t i = 0; i < profile.number_of_stacks(); ++i) {
+    const auto stack_id = static_cast<uint32_t>(i);
+    for (const uint32_t* frame = profile.stack_begin(i);
+         frame != profile.stack_end(i); ++frame) {
+      if (last_stack[*frame] == stack_id + 1) {
+        // Recursive stacks contain a frame more than once
+        continue;
+      }
+      append_posting(postings_by_frame[*frame],
+                     stack_id + 1 - last_stack[*frame]);
+      last_stack[*frame] = stack_id + 1;
+    }
+  }
+  FrameIndex frame_index{};
+  for (const auto& postings : postings_by_frame) {
+    frame_index.postings.append(postings.begin(), postings.end());
+    frame_index.posting_offsets.push_back(frame_index.postings.size());
+  }
+  return frame_index;
+}
+
+/*!
+ * \brief Calls `f(stack_id)` for the IDs of the stacks that contain the frame,
+ * in increasing order
+ */
+template <class F>
+void for_each_stack_with_frame(const FrameIndex& frame_index,
+                               const uint32_t frame_id, F&& f) {
+  const uint8_t* position =
+      frame_index.postings.data() + frame_index.posting_offsets[frame_id];
+  const uint8_t* const end =
+      frame_index.postings.data() + frame_index.posting_offsets[frame_id + 1];
+  uint32_t stack_id = 0;
+  while (position != end) {
+    uint32_t delta = 0;
+    for (uint32_t shift = 0;; shift += 7) {
+      const uint8_t byte = *position++;
+      delta |= static_cast<uint32_t>(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) {
+        break;
+      }
+    }
+    // The first delta is offset by one, see `build_frame_index`
+    stack_id += delta;
+    f(stack_id - 1);
+  }
+}
+
+/*!
+ * \brief Adds the stacks from `first_new_stack` on, which must have been
+ * appended to the profile after the index was built, to the index.
+ *
+ * The postings of the new stacks are encoded and appended to those of their
+ * frames, so only the posting lists of frames in new stacks are decoded.
+ */
+void add_to_frame_index(FrameIndex& frame_index, const FoldedProfile& profile,
+                        const size_t first_new_stack) {
+  const size_t number_of_indexed_frames =
+      frame_index.posting_offsets.size() - 1;
+  std::unordered_map<uint32_t, std::vector<uint8_t>> new_postings{};
+  // The last stack in the postings of each frame, offset by one so that zero
+  // means none, as in `build_frame_index`
+  std::unordered_map<uint32_t, uint32_t> last_stack{};
+  for (size_t i = first_new_stack; i < profile.number_of_stacks(); ++i) {
+    const auto stack_id = static_cast<uint32_t>(i);
+    for (const uint32_t* frame = profile.stack_begin(i);
+         frame != profile.stack_end(i); ++frame) {
+      auto last = last_stack.find(*frame);
+      if (last == last_stack.end()) {
+        last = last_stack.emplace(*frame, 0).first;
+        if (*frame < number_of_indexed_frames) {
+          for_each_stack_with_frame(
+              frame_index, *frame,
+              [&last](const uint32_t id) { last->second = id + 1; });
+        }
+      }
+      if (last->second == stack_id + 1) {
+        continue;
+      }
+      append_posting(new_postings[*frame], stack_id + 1 - last->second);
+      last->second = stack_id + 1;
+    }
+  }
+  // Read through a const reference so that a mapped index is not copied
+  const FrameIndex& indexed = frame_index;
+  FrameIndex updated{};
+  updated.postings.reserve(indexed.postings.size());
+  for (size_t frame_id = 0; frame_id < profile.frames.size(); ++frame_id) {
+    if (frame_id < number_of_indexed_frames) {
+      updated.postings.append(
+          indexed.postings.data() + indexed.posting_offsets[frame_id],
+          indexed.postings.data() + indexed.posting_offsets[frame_id + 1]);
+    }
+    const auto postings = new_postings.find(static_cast<uint32_t>(frame_id));
+    if (postings != new_postings.end()) {
+      updated.postings.append(postings->second.begin(),
+                              postings->second.end());
+    }
+    updated.posting_offsets.push_back(updated.postings.size());
+  }
+  frame_index = std::move(updated);
+}
+
+/*!
+ * \brief Matches regular expressions against the distinct frames of a
+ * profile, remembering the result of each regular expression so that
+ * repeating a query does not run it again
+ */
+class FrameMatcher {
+ public:
+  explicit FrameMatcher(const FoldedProfile& profile) : profile_(profile) {}
+
+  /// Whether each frame matches the regular expression. Frames added to the
+  /// profile since the last call are matched on demand.
+  const std::vector<char>& matches(const std::string& regex_string) {
+    auto& frame_matches = matches_[regex_string];
+    if (frame_matches.size() < profile_.frames.size()) {
+      const std::regex expression(regex_string);
+      for (size_t frame_id = frame_matches.size();
+           frame_id < profile_.frames.size(); ++frame_id) {
+        const auto frame = profile_.frames[frame_id];
+        frame_matches.push_back(
+            std::regex_match(frame.begin(), frame.end(), expression));
+      }
+    }
+    return frame_matches;
+  }
+
+  /// Whether each frame matches any of the regular expressions
+  std::vector<char> matches_any(const std::vector<std::string>& regexes) {
+    std::vector<char> frame_matches(profile_.frames.size(), 0);
+    for (const auto& regex_string : regexes) {
+      const auto& regex_matches = matches(regex_string);
+      for (size_t frame_id = 0; frame_id < frame_matches.size(); ++frame_id) {
+        frame_matches[frame_id] |= regex_matches[frame_id];
+      }
+    }
+    return frame_matches;
+  }
+
+ private:
+  const FoldedProfile& profile_;
+  std::map<std::string, std::vector<char>> matches_{};
+};
+
+/*!
+ * \brief Returns the sorted IDs of the stacks that contain at least one frame
+ * matching one of the regular expressions. Each regular expression is run once
+ * per distinct frame, and the stacks in the posting lists of the matching
+ * frames are marked in a bitmap over all stacks, so the cost is linear in the
+ * number of postings however many frames match.
+ */
+std::vector<uint32_t> stacks_with_matching_frame(
+    const FoldedProfile& profile, const FrameIndex& frame_index,
+    FrameMatcher& frame_matcher, const std::vector<std::string>& regexes) {
+  const auto frame_matches = frame_matcher.matches_any(regexes);
+  std::vector<char> stack_matches(profile.number_of_stacks(), 0);
+  for (size_t frame_id = 0; frame_id < profile.frames.size(); ++frame_id) {
+    if (frame_matches[frame_id]) {
+      for_each_stack_with_frame(
+          frame_index, static_cast<uint32_t>(frame_id),
+          [&stack_matches](const uint32_t stack_id) {
+            stack_matches[stack_id] = 1;
+          });
+    }
+  }
+  std::vector<uint32_t> stack_ids{};
+  for (size_t stack_id = 0; stack_id < stack_matches.size(); ++stack_id) {
+    if (stack_matches[stack_id]) {
+      stack_ids.push_back(static_cast<uint32_t>(stack_id));
+    }
+  }
+  return stack_ids;
+}
+
+/*!
+ * \brief A stack path pattern compiled to an automaton over frame IDs.
+ *
+ * A pattern lists frames from the root to the lowest frame, separated by `;`
+ * as in the folded format, and must match the whole stack. Each element is
+ * - `...`: any number of frames, including none,
+ * - `*`: exactly one frame,
+ * - one or more terms joined by `&`, each a regular expression the frame must
+ *   match, or must not match if it starts with `!`.
+ *
+ * For example `...;solve;...;MPI_Allreduce;...` selects the stacks in which
+ * `solve` calls `MPI_Allreduce` at any depth, and `...;Y&!Z;...;X` those whose
+ * lowest frame matches `X` below a frame matching `Y` but not `Z`. Use `\;`
+ * and `\&` for literal characters.
+ *
+ * The regular expressions are matched once per distinct frame. Each frame ID
+ * then maps to the set of pattern elements it satisfies, and a stack is
+ * matched in one pass over its frame IDs by shifting a bit set of active
+ * states.
+ */
+class PathPattern {
+ public:
+  PathPattern(const std::string& pattern, FrameMatcher& frame_matcher,
+              const size_t number_of_frames)
+      : transitions_(number_of_frames, 0) {
+    size_t number_of_elements = 0;
+    for (const auto& element : split_unescaped(pattern, ';')) {
+      if (element == "...") {
+        // Consecutive gaps are one gap, which keeps the closure to one step
+        if (number_of_elements == 0 or
+            not(gaps_ & (uint64_t{1} << (number_of_elements - 1)))) {
+          add_element(number_of_elements);
+          gaps_ |= uint64_t{1} << (number_of_elements - 1);
+        }
+        continue;
+      }
+      add_element(number_of_elements);
+      const uint64_t bit = uint64_t{1} << (number_of_elements - 1);
+      std::vector<char> accepted(number_of_frames, 1);
+      if (element != "*") {
+        for (const auto& term : split_unescaped(element, '&')) {
+          const bool negated = not term.empty() and term[0] == '!';
+          const auto& frame_matches =
+              frame_matcher.matches(negated ? term.substr(1) : term);
+          for (size_t frame_id = 0; frame_id < number_of_frames; ++frame_id) {
+            accepted[frame_id] &= static_cast<char>(
+                static_cast<bool>(frame_matches[frame_id]) != negated);
+          }
+        }
+      }
+      for (size_t frame_id = 0; frame_id < number_of_frames; ++frame_id) {
+        if (accepted[frame_id]) {
+          transitions_[frame_id] |= bit;
+        }
+      }
+    }
+    accepting_ = uint64_t{1} << number_of_elements;
+  }
+
+  /// Whether the frames from the root to the lowest frame match the pattern
+  bool matches(const uint32_t* const begin, const uint32_t* const end) const {
+    // Bit `i` is set if the first `i` elements match the frames read so far
+    uint64_t states = close(1);
+    for (const uint32_t* frame = begin; frame != end and states != 0;
+         ++frame) {
+      states = close(((states & transitions_[*frame]) << 1) |
+                     (states & gaps_));
+    }
+    return (states & accepting_) != 0;
+  }
+
+ private:
+  static std::vector<std::string> split_unescaped(const std::string& str,
+                                                  const char separator) {
+    std::vector<std::string> parts(1);
+    for (size_t i = 0; i < str.size(); ++i) {
+      if (str[i] == '\\' and i + 1 < str.size() and str[i + 1] == separator) {
+        parts.back() += separator;
+        ++i;
+      } else if (str[i] == separator) {
+        parts.emplace_back();
+      } else {
+        parts.back() += str[i];
+      }
+    }
+    return parts;
+  }
+
+  static void add_element(size_t& number_of_elements) {
+    if (++number_of_elements >= 64) {
+      throw std::invalid_argument(
+          "Path patterns are limited to 63 elements");
+    }
+  }
+
+  /// Adds the states reached by skipping a gap without consuming a frame
+  uint64_t close(const uint64_t states) const {
+    return states | ((states & gaps_) << 1);
+  }
+
+  std::vector<uint64_t> transitions_;
+  uint64_t gaps_ = 0;
+  uint64_t accepting_ = 0;
+};
+
+/*!
+ * \brief Returns the sorted IDs of the stacks that match at least one of the
+ * path patterns
+ */
+std::vector<uint32_t> stacks_matching_patterns(
+    const FoldedProfile& profile, FrameMatcher& frame_matcher,
+    const std::vector<std::string>& patterns) {
+  std::vector<PathPattern> path_patterns{};
+  for (const auto& pattern : patterns) {
+    path_patterns.emplace_back(pattern, frame_matcher, profile.frames.size());
+  }
+  std::vector<uint32_t> stack_ids{};
+  for (size_t stack_id = 0; stack_id < profile.number_of_stacks();
+       ++stack_id) {
+    const auto* const begin = profile.stack_begin(stack_id);
+    const auto* const end = profile.stack_end(stack_id);
+    for (const auto& path_pattern : path_patterns) {
+      if (path_pattern.matches(begin, end)) {
+        stack_ids.push_back(static_cast<uint32_t>(stack_id));
+        break;
+      }
+    }
+  }
+  return stack_ids;
+}
+
+/*!
+ * \brief Returns the sorted IDs of the stacks that pass through a frame
+ * matching one of `regexes_to_focus` (all stacks if it is empty), through no
+ * frame matching one of `regexes_to_hide`, and match one of the path
+ * `patterns_to_match` (all stacks if it is empty)
+ */
+std::vector<uint32_t> select_stacks(
+    const FoldedProfile& profile, const FrameIndex& frame_index,
+    FrameMatcher& frame_matcher,
+    const std::vector<std::string>& regexes_to_focus,
+    const std::vector<std::string>& regexes_to_hide,
+    const std::vector<std::string>& patterns_to_match) {
+  std::vector<uint32_t> stack_ids{};
+  if (regexes_to_focus.empty()) {
+    stack_ids.resize(profile.number_of_stacks());
+    std::iota(stack_ids.begin(), stack_ids.end(), uint32_t{0});
+  } else {
+    stack_ids = stacks_with_matching_frame(profile, frame_index, frame_matcher,
+                                           regexes_to_focus);
+  }
+  if (not regexes_to_hide.empty()) {
+    const auto hidden_stack_ids = stacks_with_matching_frame(
+        profile, frame_index, frame_matcher, regexes_to_hide);
+    std::vector<uint32_t> shown_stack_ids{};
+    std::set_difference(stack_ids.begin(), stack_ids.end(),
+                        hidden_stack_ids.begin(), hidden_stack_ids.end(),
+                        std::back_inserter(shown_stack_ids));
+    stack_ids.swap(shown_stack_ids);
+  }
+  if (not patterns_to_match.empty()) {
+    const auto matching_stack_ids =
+        stacks_matching_patterns(profile, frame_matcher, patterns_to_match);
+    std::vector<uint32_t> shown_stack_ids{};
+    std::set_intersection(stack_ids.begin(), stack_ids.end(),
+                          matching_stack_ids.begin(), matching_stack_ids.end(),
+                          std::back_inserter(shown_stack_ids));
+    stack_ids.swap(shown_stack_ids);
+  }
+  return stack_ids;
+}
+
+/*!
+ * \brief The stacks of a profile merged into a tree rooted at their lowest
+ * frames, so that a node at depth `d` is the last `d` frames of the stacks
+ * passing through it.
+ *
+ * Node 0 is the root and has no frame. The children of the root are sorted by
+ * the name of their frame and all other children are in order of first
+ * appearance. The merged output for a stack limit `d` is then the nodes above
+ * depth `d` that stacks end at, plus all nodes at depth `d`.
+ */
+struct LeafTree {
+  static constexpr uint32_t no_node = std::numeric_limits<uint32_t>::max();
+
+  SharedArray<uint32_t> frames{0};
+  SharedArray<uint32_t> parents{no_node};
+  SharedArray<uint32_t> first_children{no_node};
+  SharedArray<uint32_t> next_siblings{no_node};
+  /// The samples of all stacks passing through the node
+  SharedArray<double> inclusive_counts{0};
+  /// The samples of the stacks ending at the node
+  SharedArray<double> terminal_counts{0};
+
+  size_t number_of_nodes() const { return frames.size(); }
+};
+
+constexpr uint32_t LeafTree::no_node;
+
+/*!
+ * \brief Merges the given stacks into a `LeafTree` of the values of `metric`,
+ * ignoring all frames deeper than `max_depth` unless it is zero.
+ *
+ * The nodes only depend on the stacks and `max_depth`, so trees of different
+ * metrics built from the same stacks have the same node IDs.
+ */
+LeafTree build_leaf_tree(const FoldedProfile& profile,
+                         const std::vector<uint32_t>& stack_ids,
+                         const size_t max_depth = 0, const size_t metric = 0) {
+  const auto& values = profile.metric_values(metric);
+  LeafTree tree{};
+  std::vector<uint32_t> last_children{LeafTree::no_node};
+  std::unordered_map<uint64_t, uint32_t> children{};
+  for (const auto stack_id : stack_ids) {
+    const double sample_count = values[stack_id];
+    const uint32_t* const begin = profile.stack_begin(stack_id);
+    const uint32_t* frame = profile.stack_end(stack_id);
+    uint32_t node = 0;
+    tree.inclusive_counts[node] += sample_count;
+    size_t depth = 0;
+    while (frame != begin and (max_depth == 0 or depth < max_depth)) {
+      --frame;
+      ++depth;
+      const uint64_t key = (static_cast<uint64_t>(node) << 32) | *frame;
+      const auto child = children.find(key);
+      if (child != children.end()) {
+        node = child->second;
+      } else {
+        const auto new_node = static_cast<uint32_t>(tree.number_of_nodes());
+        tree.frames.push_back(*frame);
+        tree.parents.push_back(node);
+        tree.first_children.push_back(LeafTree::no_node);
+        tree.next_siblings.push_back(LeafTree::no_node);
+        tree.inclusive_counts.push_back(0);
+        tree.terminal_counts.push_back(0);
+        last_children.push_back(LeafTree::no_node);
+        if (last_children[node] == LeafTree::no_node) {
+          tree.first_children[node] = new_node;
+        } else {
+          tree.next_siblings[last_children[node]] = new_node;
+        }
+        last_children[node] = new_node;
+        children.emplace(key, new_node);
+        node = new_node;
+      }
+      tree.inclusive_counts[node] += sample_count;
+    }
+    if (frame == begin) {
+      tree.terminal_counts[node] += sample_count;
+    }
+  }
+
+  std::vector<uint32_t> lowest_frame_nodes{};
+  for (uint32_t node = tree.first_children[0]; node != LeafTree::no_node;
+       node = tree.next_siblings[node]) {
+    lowest_frame_nodes.push_back(node);
+  }
+  std::stable_sort(lowest_frame_nodes.begin(), lowest_frame_nodes.end(),
+                   [&profile, &tree](const uint32_t a, const uint32_t b) {
+                     return profile.frames[tree.frames[a]] <
+                            profile.frames[tree.frames[b]];
+                   });
+  uint32_t* next = &tree.first_children[0];
+  for (const auto node : lowest_frame_nodes) {
+    *next = node;
+    next = &tree.next_siblings[node];
+  }
+  *next = LeafTree::no_node;
+  return tree;
+}
+
+/*!
+ * \brief Formats a value for a folded line, without a fractional part if it is
+ * a whole number
+ */
+std::string format_weight(const double weight) {
+  char buffer[32];
+  if (weight == std::floor(weight) and std::fabs(weight) < 1.0e18) {
+    std::snprintf(buffer, sizeof(buffer), "%.0f", weight);
+  } else {
+    std::snprintf(buffer, sizeof(buffer), "%.15g", weight);
+    if (std::strtod(buffer, nullptr) != weight) {
+      std::snprintf(buffer, sizeof(buffer), "%.17g", weight);
+    }
+  }
+  return buffer;
+}
+
+/*!
+ * \brief Calls `task(i)` for every `i` below `number_of_tasks`, spread over up
+ * to `number_of_threads` threads including the calling one.
+ *
+ * If a task throws, no further tasks are started and the first exception is
+ * rethrown on the calling thread once all threads have finished.
+ */
+template <class Task>
+void run_in_parallel(const size_t number_of_tasks,
+                     const size_t number_of_threads, const Task& task) {
+  std::atomic<size_t> next_task{0};
+  std::mutex error_mutex{};
+  std::exception_ptr error{};
+  const auto work = [&]() {
+    try {
+      for (size_t i = next_task.fetch_add(1); i < number_of_tasks;
+           i = next_task.fetch_add(1)) {
+        task(i);
+      }
+    } catch (...) {
+      next_task.store(number_of_tasks);
+      std::lock_guard<std::mutex> lock(error_mutex);
+      if (error == nullptr) {
+        error = std::current_exception();
+      }
+    }
+  };
+  std::vector<std::thread> threads{};
+  for (size_t i = 1; i < std::min(number_of_threads, number_of_tasks); ++i) {
+    threads.emplace_back(work);
+  }
+  work();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  if (error != nullptr) {
+    std::rethrow_exception(error);
+  }
+}
+
+/*!
+ * \brief Sorts `values` by `compare`, which must be a strict total order, by
+ * sorting chunks on separate threads and merging them pairwise in parallel.
+ * The result does not depend on the number of threads.
+ */
+template <class Compare>
+void parallel_sort(std::vector<uint32_t>& values, const Compare& compare) {
+  // Small inputs are sorted faster than threads are started
+  constexpr size_t min_values_per_thread = 1 << 15;
+  const size_t number_of_threads = std::max<size_t>(
+      1, std::min<size_t>(std::thread::hardware_concurrency(),
+                          values.size() / min_values_per_thread));
+  const size_t chunk_size =
+      (values.size() + number_of_threads - 1) / number_of_threads;
+  const auto at = [&values](const size_t i) {
+    return values.begin() +
+           static_cast<std::ptrdiff_t>(std::min(i, values.size()));
+  };
+  run_in_parallel(number_of_threads, number_of_threads, [&](const size_t i) {
+    std::sort(at(i * chunk_size), at((i + 1) * chunk_size), compare);
+  });
+  for (size_t width = chunk_size; width < values.size(); width *= 2) {
+    run_in_parallel((values.size() + 2 * width - 1) / (2 * width),
+                    number_of_threads, [&](const size_t i) {
+                      std::inplace_merge(at(2 * i * width),
+                                         at((2 * i + 1) * width),
+                                         at((2 * i + 2) * width), compare);
+                    });
+  }
+}
+
+/*!
+ * \brief The order of the lines of a written profile
+ */
+enum class OutputOrder {
+  /// Grouped by lowest frame in the order the filter visits them
+  input,
+  /// By decreasing weight, and by name for equal weights
+  weight,
+  /// By the names of the frames from the root, frame by frame
+  name
+};
+
+OutputOrder parse_output_order(const std::string& order) {
+  if (order == "input") {
+    return OutputOrder::input;
+  } else if (order == "weight") {
+    return OutputOrder::weight;
+  } else if (order == "name") {
+    return OutputOrder::name;
+  }
+  throw std::invalid_argument("Unknown output order '" + order +
+                              "', expected input, weight or name");
+}
+
+/*!
+ * \brief Writes folded lines given as frame IDs, either as they are added or,
+ * for a canonical order, all at once when closed.
+ *
+ * Sorted lines are kept as frame IDs and compared through compact keys: the
+ * rank of each frame name and the bits of each weight as an unsigned integer,
+ * so that no strings are compared and the output is the same on every run.
+ */
+class FoldedLineWriter {
+ public:
+  FoldedLineWriter(const FoldedProfile& profile,
+                   const std::string& out_filename, const OutputOrder order)
+      : profile_(profile),
+        out_filename_(out_filename),
+        out_file_(out_filename),
+        order_(order) {
+    if (not out_file_.is_open()) {
+      throw std::runtime_error("Could not open file: " + out_filename +
+                               " for writing");
+    }
+  }
+
+  /// Adds the line of the frames in [begin, end) from the root to the lowest
+  /// frame with the given weight
+  void add(const uint32_t* const begin, const uint32_t* const end,
+           const double weight) {
+    if (order_ == OutputOrder::input) {
+      write_line(begin, end, weight);
+      return;
+    }
+    frames_.insert(frames_.end(), begin, end);
+    line_ends_.push_back(frames_.size());
+    weights_.push_back(weight);
+  }
+
+  /// Writes the lines in order if they were kept and closes the file,
+  /// throwing if the file could not be written
+  void close() {
+    if (order_ != OutputOrder::input) {
+      write_sorted_lines();
+    }
+    out_file_.close();
+    if (not out_file_) {
+      throw std::runtime_error("Could not write file: " + out_filename_);
+    }
+  }
+
+ private:
+  void write_line(const uint32_t* const begin, const uint32_t* const end,
+                  const double weight) {
+    line_.clear();
+    for (const uint32_t* frame = begin; frame != end; ++frame) {
+      if (frame != begin) {
+        line_ += ';';
+      }
+      const auto name = profile_.frames[*frame];
+      line_.append(name.data(), name.size());
+    }
+    line_ += ' ';
+    line_ += format_weight(weight);
+    line_ += '\n';
+    out_file_ << line_;
+  }
+
+  /// Maps a weight to an integer with the same order, NaNs included
+  static uint64_t weight_key(const double weight) {
+    uint64_t bits = 0;
+    std::memcpy(&bits, &weight, sizeof(bits));
+    return (bits >> 63) != 0 ? ~bits : bits | (uint64_t{1} << 63);
+  }
+
+  void write_sorted_lines() {
+    std::vector<uint32_t> frames_by_name(profile_.frames.size());
+    std::iota(frames_by_name.begin(), frames_by_name.end(), uint32_t{0});
+    parallel_sort(frames_by_name, [this](const uint32_t a, const uint32_t b) {
+      return profile_.frames[a] < profile_.frames[b] or
+             (profile_.frames[a] == profile_.frames[b] and a < b);
+    });
+    std::vector<uint32_t> frame_ranks(frames_by_name.size());
+    for (size_t rank = 0; rank < frames_by_name.size(); ++rank) {
+      frame_ranks[frames_by_name[rank]] = static_cast<uint32_t>(rank);
+    }
+    for (auto& frame : frames_) {
+      frame = frame_ranks[frame];
+    }
+    std::vector<uint64_t> weight_keys(weights_.size());
+    std::transform(weights_.begin(), weights_.end(), weight_keys.begin(),
+                   weight_key);
+
+    const auto line_begin = [this](const uint32_t line) {
+      return frames_.data() + (line == 0 ? 0 : line_ends_[line - 1]);
+    };
+    const auto line_end = [this](const uint32_t line) {
+      return frames_.data() + line_ends_[line];
+    };
+    const auto name_less = [&](const uint32_t a, const uint32_t b) {
+      return std::lexicographical_compare(line_begin(a), line_end(a),
+                                          line_begin(b), line_end(b));
+    };
+    const bool by_weight = order_ == OutputOrder::weight;
+    std::vector<uint32_t> lines(weights_.size());
+    std::iota(lines.begin(), lines.end(), uint32_t{0});
+    parallel_sort(lines, [&](const uint32_t a, const uint32_t b) {
+      if (by_weight and weight_keys[a] != weight_keys[b]) {
+        return weight_keys[a] > weight_keys[b];
+      }
+      if (name_less(a, b)) {
+        return true;
+      }
+      return not name_less(b, a) and a < b;
+    });
+
+    std::vector<uint32_t> frame_ids{};
+    for (const auto line : lines) {
+      frame_ids.clear();
+      for (const uint32_t* rank = line_begin(line); rank != line_end(line);
+           ++rank) {
+        frame_ids.push_back(frames_by_name[*rank]);
+      }
+      write_line(frame_ids.data(), frame_ids.data() + frame_ids.size(),
+                 weights_[line]);
+    }
+  }
+
+  const FoldedProfile& profile_;
+  std::string out_filename_;
+  std::ofstream out_file_;
+  const OutputOrder order_;
+  std::string line_{};
+  /// The frames of the kept lines, or their name ranks once sorting starts
+  std::vector<uint32_t> frames_{};
+  std::vector<size_t> line_ends_{};
+  std::vector<double> weights_{};
+};
+
+/*!
+ * \brief Writes the stacks of the tree merged to `stack_limit` frames as
+ * folded lines, skipping the lowest frames for which `frame_is_shown` is zero.
+ * If `numerator_tree` is given, it must be built from the same stacks and
+ * each line has the ratio of its value to the value of `tree`.
+ *
+ * Only the nodes up to depth `stack_limit` are visited, so this is independent
+ * of the size of the profile below that depth.
+ */
+void write_leaf_tree_to_file(const FoldedProfile& profile,
+                             const LeafTree& tree,
+                             const std::vector<char>& frame_is_shown,
+                             const size_t stack_limit,
+                             const std::string& out_filename,
+                             const LeafTree* const numerator_tree = nullptr,
+                             const OutputOrder order = OutputOrder::input) {
+  FoldedLineWriter writer(profile, out_filename, order);
+  // The frames from the lowest frame up to the current node
+  std::vector<uint32_t> path{};
+  std::vector<uint32_t> root_first_path{};
+  uint32_t node = tree.first_children[0];
+  size_t depth = 1;
+  while (node != LeafTree::no_node) {
+    const bool skip = depth == 1 and not frame_is_shown[tree.frames[node]];
+    if (not skip) {
+      path.resize(depth);
+      path[depth - 1] = tree.frames[node];
+      const auto& counts = depth == stack_limit ? tree.inclusive_counts
+                                                : tree.terminal_counts;
+      const double sample_count = counts[node];
+      if (sample_count != 0) {
+        root_first_path.assign(path.rbegin(), path.rend());
+        double weight = sample_count;
+        if (numerator_tree != nullptr) {
+          const auto& numerators = depth == stack_limit
+                                       ? numerator_tree->inclusive_counts
+                                       : numerator_tree->terminal_counts;
+          weight = numerators[node] / sample_count;
+        }
+        writer.add(root_first_path.data(),
+                   root_first_path.data() + root_first_path.size(), weight);
+      }
+      if ((stack_limit == 0 or depth < stack_limit) and
+          tree.first_children[node] != LeafTree::no_node) {
+        node = tree.first_children[node];
+        ++depth;
+        continue;
+      }
+    }
+    while (node != LeafTree::no_node and
+           tree.next_siblings[node] == LeafTree::no_node) {
+      node = tree.parents[node];
+      --depth;
+    }
+    if (node != LeafTree::no_node) {
+      node = tree.next_siblings[node];
+    }
+  }
+  writer.close();
+}
+
+/*!
+ * \brief A profile together with the structures derived from it that are
+ * stored in the binary index
+ */
+struct IndexedProfile {
+  FoldedProfile profile{};
+  FrameIndex frame_index{};
+  LeafTree leaf_tree{};
+  /// If non-zero the output is the ratio of this metric to the first one,
+  /// which is still used for the cutoff. Not stored in the index.
+  size_t ratio_metric = 0;
+  /// The order of the written lines. Not stored in the index.
+  OutputOrder output_order = OutputOrder::input;
+  /// The memory mapped image the arrays refer to, if any
+  std::shared_ptr<const char> storage{};
+};
+
+/*!
+ * \brief Builds the inverted frame index and leaf tree of the profile
+ */
+void build_derived_indexes(IndexedProfile& indexed_profile) {
+  const auto& profile = indexed_profile.profile;
+  indexed_profile.frame_index = build_frame_index(profile);
+  std::vector<uint32_t> all_stack_ids(profile.number_of_stacks());
+  std::iota(all_stack_ids.begin(), all_stack_ids.end(), uint32_t{0});
+  indexed_profile.leaf_tree = build_leaf_tree(profile, all_stack_ids);
+}
+
+/*!
+ * \brief Adds `weights[i]` of the values of `metric` to the path of each stack
+ * `i` in the tree, adding nodes for paths that are not in it yet. Stacks
+ * without weight are skipped unless they are at least `first_new_stack`.
+ *
+ * The children of a node are only looked up in a hash table once the node is
+ * visited, so the cost depends on the stacks that changed rather than on the
+ * size of the tree. New children of the root are inserted by name, all others
+ * are appended, as `build_leaf_tree` orders them.
+ */
+void add_to_leaf_tree(LeafTree& tree, const FoldedProfile& profile,
+                      const std::vector<double>& weights,
+                      const size_t first_new_stack) {
+  std::unordered_map<uint64_t, uint32_t> children{};
+  std::vector<uint32_t> last_children{};
+  std::vector<char> children_known{};
+  const auto child = [&](const uint32_t node, const uint32_t frame) {
+    if (node >= children_known.size()) {
+      children_known.resize(tree.number_of_nodes(), 0);
+      last_children.resize(tree.number_of_nodes(), LeafTree::no_node);
+    }
+    if (not children_known[node]) {
+      for (uint32_t c = tree.first_children[node]; c != LeafTree::no_node;
+           c = tree.next_siblings[c]) {
+        children.emplace((static_cast<uint64_t>(node) << 32) | tree.frames[c],
+                         c);
+        last_children[node] = c;
+      }
+      children_known[node] = 1;
+    }
+    const uint64_t key = (static_cast<uint64_t>(node) << 32) | frame;
+    const auto found = children.find(key);
+    if (found != children.end()) {
+      return found->second;
+    }
+    const auto new_node = static_cast<uint32_t>(tree.number_of_nodes());
+    tree.frames.push_back(frame);
+    tree.parents.push_back(node);
+    tree.first_children.push_back(LeafTree::no_node);
+    tree.next_siblings.push_back(LeafTree::no_node);
+    tree.inclusive_counts.push_back(0);
+    tree.terminal_counts.push_back(0);
+    children_known.push_back(1);
+    last_children.push_back(LeafTree::no_node);
+    if (node == 0) {
+      uint32_t* next = &tree.first_children[0];
+      while (*next != LeafTree::no_node and
+             profile.frames[tree.frames[*next]] <= profile.frames[frame]) {
+        next = &tree.next_siblings[*next];
+      }
+      tree.next_siblings[new_node] = *next;
+      *next = new_node;
+    } else if (last_children[node] == LeafTree::no_node) {
+      tree.first_children[node] = new_node;
+    } else {
+      tree.next_siblings[last_children[node]] = new_node;
+    }
+    if (node != 0) {
+      last_children[node] = new_node;
+    }
+    children.emplace(key, new_node);
+    return new_node;
+  };
+  for (size_t stack_id = 0; stack_id < weights.size(); ++stack_id) {
+    const double weight = weights[stack_id];
+    if (weight == 0 and stack_id < first_new_stack) {
+      continue;
+    }
+    uint32_t node = 0;
+    tree.inclusive_counts[node] += weight;
+    for (const uint32_t* frame = profile.stack_end(stack_id);
+         frame != profile.stack_begin(stack_id);) {
+      node = child(node, *--frame);
+      tree.inclusive_counts[node] += weight;
+    }
+    tree.terminal_counts[node] += weight;
+  }
+}
+
+/*!
+ * \brief Updates the derived indexes after lines were parsed into a profile
+ * they were built from. The stacks from `first_new_stack` on are new, and
+ * `previous_counts` are the sample counts of the other stacks when the indexes
+ * were built.
+ */
+void update_derived_indexes(IndexedProfile& indexed_profile,
+                            const size_t first_new_stack,
+                            const SharedArray<double>& previous_counts) {
+  const auto& profile = indexed_profile.profile;
+  add_to_frame_index(indexed_profile.frame_index, profile, first_new_stack);
+  std::vector<double> weights(profile.sample_counts.begin(),
+                              profile.sample_counts.end());
+  for (size_t stack_id = 0; stack_id < first_new_stack; ++stack_id) {
+    weights[stack_id] -= previous_counts[stack_id];
+  }
+  add_to_leaf_tree(indexed_profile.leaf_tree, profile, weights,
+                   first_new_stack);
+}
+
+/*!
+ * \brief The identification of the input a binary index was built from
+ */
+struct IndexedInput {
+  /// The number of bytes of the input file that were parsed
+  uint64_t bytes;
+  /// The modification time of the input file in nanoseconds since the epoch
+  int64_t modification_time;
+  /// `hash_file_edges` of those bytes, to tell cheaply whether the file is
+  /// unchanged
+  uint64_t hash;
+  /// `hash_file` of those bytes, to tell whether the file only had lines
+  /// appended
+  uint64_t contents_hash;
+  /// Whether the parsed bytes end with a newline, i.e. whether appended data
+  /// starts a new line
+  bool ends_with_newline;
+};
+
+constexpr char index_magic[8] = {'F', 'G', 'F', 'I', 'D', 'X', '0', '8'};
+
+/*!
+ * \brief Pads the stream with zeros to a multiple of eight bytes, so that
+ * arrays in a memory mapped image are aligned
+ */
+void write_padding(std::ostream& os) {
+  const char zeros[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  os.write(zeros, (8 - static_cast<std::streamoff>(os.tellp()) % 8) % 8);
+}
+
+template <class T>
+void write_binary(std::ostream& os, const T& value) {
+  os.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <class T>
+void write_binary(std::ostream& os, const SharedArray<T>& values) {
+  write_binary(os, static_cast<uint64_t>(values.size()));
+  os.write(reinterpret_cast<const char*>(values.data()),
+           static_cast<std::streamsize>(values.size() * sizeof(T)));
+  write_padding(os);
+}
+
+/*!
+ * \brief Reads values out of a binary image held in memory. Arrays are not
+ * copied but refer to the image, which must outlive them.
+ */
+class ImageReader {
+ public:
+  ImageReader(const char* const data, const size_t size)
+      : data_(data), size_(size) {}
+
+  template <class T>
+  bool read(T& value) {
+    if (position_ + sizeof(T) > size_) {
+      return false;
+    }
+    std::memcpy(&value, data_ + position_, sizeof(T));
+    position_ += sizeof(T);
+    return true;
+  }
+
+  template <class T>
+  bool read(SharedArray<T>& values) {
+    uint64_t size = 0;
+    if (not read(size) or size > (size_ - position_) / sizeof(T)) {
+      return false;
+    }
+    values = SharedArray<T>::view(
+        reinterpret_cast<const T*>(data_ + position_), size);
+    position_ += size * sizeof(T);
+    skip_padding();
+    return true;
+  }
+
+  bool read(std::string& str, const size_t size) {
+    if (position_ + size > size_) {
+      return false;
+    }
+    str.assign(data_ + position_, size);
+    position_ += size;
+    return true;
+  }
+
+  void skip_padding() { position_ = std::min(size_, (position_ + 7) / 8 * 8); }
+
+ private:
+  const char* data_;
+  size_t size_;
+  size_t position_ = 0;
+};
+
+/*!
+ * \brief Maps the whole file read-only into memory. Returns a null pointer if
+ * the file cannot be mapped.
+ */
+std::shared_ptr<const char> map_file(const int file_descriptor,
+                                     size_t& size) {
+  struct stat file_stat {};
+  if (::fstat(file_descriptor, &file_stat) != 0 or file_stat.st_size == 0) {
+    return nullptr;
+  }
+  size = static_cast<size_t>(file_stat.st_size);
+  void* const mapping =
+      ::mmap(nullptr, size, PROT_READ, MAP_SHARED, file_descriptor, 0);
+  if (mapping == MAP_FAILED) {
+    return nullptr;
+  }
+  const size_t mapped_size = size;
+  return std::shared_ptr<const char>(
+      static_cast<const char*>(mapping), [mapped_size](const char* data) {
+        ::munmap(const_cast<char*>(data), mapped_size);
+      });
+}
+
+/*!
+ * \brief Writes the frame dictionary, stacks, and counts of the profile
+ */
+void write_profile(std::ostream& os, const FoldedProfile& profile) {
+  write_binary(os, profile.frames.name_offsets);
+  write_binary(os, profile.frames.characters);
+  write_binary(os, profile.stack_offsets);
+  write_binary(os, profile.stack_frames);
+  write_binary(os, profile.sample_counts);
+  write_binary(os, static_cast<uint64_t>(profile.number_of_metrics()));
+  for (const auto& metric_name : profile.metric_names) {
+    write_binary(os, static_cast<uint32_t>(metric_name.size()));
+    os.write(metric_name.data(),
+             static_cast<std::streamsize>(metric_name.size()));
+  }
+  write_padding(os);
+  for (const auto& values : profile.other_metric_values) {
+    write_binary(os, values);
+  }
+}
+
+/*!
+ * \brief Reads a profile written by `write_profile`, returning false if the
+ * image is truncated. The frame dictionary and the arrays refer to the image,
+ * and the lookup tables are rebuilt only once frames or stacks are added.
+ */
+bool read_profile(ImageReader& image, FoldedProfile& profile) {
+  if (not image.read(profile.frames.name_offsets) or
+      not image.read(profile.frames.characters) or
+      profile.frames.name_offsets.empty() or
+      profile.frames.name_offsets[0] != 0 or
+      profile.frames.name_offsets.back() != profile.frames.characters.size()) {
+    return false;
+  }
+  profile.frame_ids.clear();
+  profile.stack_lookup.clear();
+  uint64_t number_of_metrics = 0;
+  if (not image.read(profile.stack_offsets) or
+      not image.read(profile.stack_frames) or
+      not image.read(profile.sample_counts) or
+      profile.stack_offsets.size() != profile.sample_counts.size() + 1 or
+      not image.read(number_of_metrics) or number_of_metrics == 0) {
+    return false;
+  }
+  profile.metric_names.resize(number_of_metrics);
+  for (auto& metric_name : profile.metric_names) {
+    uint32_t size = 0;
+    if (not image.read(size) or not image.read(metric_name, size)) {
+      return false;
+    }
+  }
+  image.skip_padding();
+  profile.other_metric_values.resize(number_of_metrics - 1);
+  for (auto& values : profile.other_metric_values) {
+    if (not image.read(values) or
+        values.size() != profile.sample_counts.size()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*!
+ * \brief Writes the profile and its derived indexes
+ */
+void write_indexed_profile(std::ostream& os,
+                           const IndexedProfile& indexed_profile) {
+  write_profile(os, indexed_profile.profile);
+  const auto& frame_index = indexed_profile.frame_index;
+  write_binary(os, frame_index.posting_offsets);
+  write_binary(os, frame_index.postings);
+  const auto& tree = indexed_profile.leaf_tree;
+  write_binary(os, tree.frames);
+  write_binary(os, tree.parents);
+  write_binary(os, tree.first_children);
+  write_binary(os, tree.next_siblings);
+  write_binary(os, tree.inclusive_counts);
+  write_binary(os, tree.terminal_counts);
+}
+
+/*!
+ * \brief Reads a profile and its derived indexes written by
+ * `write_indexed_profile`
+ */
+bool read_indexed_profile(ImageReader& image,
+                          IndexedProfile& indexed_profile) {
+  auto& frame_index = indexed_profile.frame_index;
+  auto& tree = indexed_profile.leaf_tree;
+  return read_profile(image, indexed_profile.profile) and
+         image.read(frame_index.posting_offsets) and
+         image.read(frame_index.postings) and
+         frame_index.posting_offsets.size() ==
+             indexed_profile.profile.frames.size() + 1 and
+         image.read(tree.frames) and image.read(tree.parents) and
+         image.read(tree.first_children) and image.read(tree.next_siblings) and
+         image.read(tree.inclusive_counts) and
+         image.read(tree.terminal_counts);
+}
+
+/*!
+ * \brief Writes the binary index of `input_filename`.
+ *
+ * The index is written to a temporary file that is then renamed, so that
+ * processes that have the previous index mapped are not affected.
+ */
+void write_index(const std::string& index_filename,
+                 const IndexedInput& indexed_input,
+                 const IndexedProfile& indexed_profile) {
+  const std::string temporary_filename =
+      index_filename + ".tmp." + std::to_string(::getpid());
+  std::ofstream index_file(temporary_filename, std::ios::binary);
+  if (not index_file.is_open()) {
+    std::cerr << "Could not open file: " << temporary_filename
+              << " for writing\n";
+    std::exit(1);
+  }
+  index_file.write(index_magic, sizeof(index_magic));
+  write_binary(index_file, indexed_input.bytes);
+  write_binary(index_file, indexed_input.modification_time);
+  write_binary(index_file, indexed_input.hash);
+  write_binary(index_file, indexed_input.contents_hash);
+  write_binary(index_file,
+               static_cast<uint8_t>(indexed_input.ends_with_newline));
+  write_padding(index_file);
+  write_indexed_profile(index_file, indexed_profile);
+  index_file.close();
+  if (not index_file or
+      std::rename(temporary_filename.c_str(), index_filename.c_str()) != 0) {
+    std::remove(temporary_filename.c_str());
+    std::cerr << "Could not write index: " << index_filename << "\n";
+    std::exit(1);
+  }
+}
+
+/*!
+ * \brief Maps a binary index written by `write_index`, returning false if the
+ * file does not exist or is not a valid index.
+ *
+ * The index is used straight from the mapping rather than read into memory.
+ */
+bool read_index(const std::string& index_filename, IndexedInput& indexed_input,
+                IndexedProfile& indexed_profile) {
+  const int file_descriptor = ::open(index_filename.c_str(), O_RDONLY);
+  if (file_descriptor < 0) {
+    return false;
+  }
+  size_t size = 0;
+  indexed_profile.storage = map_file(file_descriptor, size);
+  ::close(file_descriptor);
+  if (indexed_profile.storage == nullptr) {
+    return false;
+  }
+  ImageReader image(indexed_profile.storage.get(), size);
+  char magic[sizeof(index_magic)];
+  uint8_t ends_with_newline = 0;
+  for (auto& c : magic) {
+    if (not image.read(c)) {
+      return false;
+    }
+  }
+  if (not std::equal(magic, magic + sizeof(magic), index_magic) or
+      not image.read(indexed_input.bytes) or
+      not image.read(indexed_input.modification_time) or
+      not image.read(indexed_input.hash) or
+      not image.read(indexed_input.contents_hash) or
+      not image.read(ends_with_newline)) {
+    return false;
+  }
+  image.skip_padding();
+  indexed_input.ends_with_newline = ends_with_newline != 0;
+  return read_indexed_profile(image, indexed_profile);
+}
+
+/*!
+ * \brief A stream buffer that writes to a file descriptor, for writing
+ * images to shared memory segments
+ */
+class FileDescriptorBuffer : public std::streambuf {
+ public:
+  explicit FileDescriptorBuffer(const int file_descriptor)
+      : file_descriptor_(file_descriptor), buffer_(size_t{1} << 20) {
+    setp(buffer_.data(), buffer_.data() + buffer_.size());
+  }
+
+  ~FileDescriptorBuffer() override { sync(); }
+
+  bool failed() const { return failed_; }
+
+ protected:
+  int_type overflow(const int_type c) override {
+    if (sync() != 0) {
+      return traits_type::eof();
+    }
+    if (not traits_type::eq_int_type(c, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+  int sync() override {
+    const char* data = pbase();
+    while (data != pptr()) {
+      const ssize_t written =
+          ::write(file_descriptor_, data, static_cast<size_t>(pptr() - data));
+      if (written <= 0) {
+        failed_ = true;
+        return -1;
+      }
+      data += written;
+      bytes_written_ += written;
+    }
+    setp(buffer_.data(), buffer_.data() + buffer_.size());
+    return 0;
+  }
+
+  // Only supports querying the position, which `write_padding` needs
+  pos_type seekoff(const off_type offset, const std::ios_base::seekdir dir,
+                   const std::ios_base::openmode /*which*/) override {
+    if (offset != 0 or dir != std::ios_base::cur) {
+      return pos_type(off_type(-1));
+    }
+    return pos_type(bytes_written_ + (pptr() - pbase()));
+  }
+
+ private:
+  int file_descriptor_;
+  std::vector<char> buffer_;
+  off_type bytes_written_ = 0;
+  bool failed_ = false;
+};
+
+constexpr char shared_profile_magic[8] = {'F', 'G', 'F', 'S',
+                                          'H', 'M', '0', '3'};
+
+/*!
+ * \brief Returns the name of the POSIX shared memory segment, which must start
+ * with a slash
+ */
+std::string shared_memory_name(const std::string& name) {
+  return name.empty() or name[0] != '/' ? "/" + name : name;
+}
+
+/*!
+ * \brief Parses the octal permissions of a shared memory segment given with
+ * `--shm-mode`, e.g. `0640`, throwing if they are not of that form
+ */
+mode_t parse_shared_memory_mode(const std::string& mode) {
+  char* end = nullptr;
+  const unsigned long value = std::strtoul(mode.c_str(), &end, 8);
+  if (mode.empty() or mode[0] == '-' or mode[0] == '+' or *end != '\0' or
+      value > 0777) {
+    throw std::invalid_argument("The --shm-mode '" + mode +
+                                "' is not an octal mode such as 0640");
+  }
+  return static_cast<mode_t>(value);
+}
+
+/*!
+ * \brief Copies the profile and its derived indexes into the named POSIX
+ * shared memory segment, replacing any existing segment of that name. The
+ * segment gets the permissions `mode` regardless of the umask, so that e.g.
+ * the members of a group can map it.
+ *
+ * The magic number is written last so that processes mapping the segment
+ * while it is written reject it instead of reading a partial profile.
+ */
+void publish_shared_profile(const std::string& name, const mode_t mode,
+                            const IndexedProfile& indexed_profile) {
+  const std::string segment = shared_memory_name(name);
+  ::shm_unlink(segment.c_str());
+  // Created accessible to the owner only and opened up once complete
+  const int file_descriptor =
+      ::shm_open(segment.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (file_descriptor < 0) {
+    std::cerr << "Could not create shared memory segment: " << segment << "\n";
+    std::exit(1);
+  }
+  bool failed = false;
+  {
+    FileDescriptorBuffer buffer(file_descriptor);
+    std::ostream os(&buffer);
+    const char placeholder[sizeof(shared_profile_magic)] = {};
+    os.write(placeholder, sizeof(placeholder));
+    write_indexed_profile(os, indexed_profile);
+    os.flush();
+    failed = buffer.failed() or not os;
+  }
+  if (failed or
+      ::pwrite(file_descriptor, shared_profile_magic,
+               sizeof(shared_profile_magic),
+               0) != sizeof(shared_profile_magic) or
+      ::fchmod(file_descriptor, mode) != 0) {
+    ::close(file_descriptor);
+    ::shm_unlink(segment.c_str());
+    std::cerr << "Could not write shared memory segment: " << segment << "\n";
+    std::exit(1);
+  }
+  ::close(file_descriptor);
+  std::cerr << "Published the profile as shared memory segment " << segment
+            << "\n";
+}
+
+/*!
+ * \brief Maps the profile published with `publish_shared_profile` read-only.
+ * All processes mapping the segment share the same physical memory.
+ */
+IndexedProfile map_shared_profile(const std::string& name) {
+  const std::string segment = shared_memory_name(name);
+  const int file_descriptor = ::shm_open(segment.c_str(), O_RDONLY, 0);
+  if (file_descriptor < 0) {
+    std::cerr << "Could not open shared memory segment: " << segment << "\n";
+    std::exit(1);
+  }
+  IndexedProfile indexed_profile{};
+  size_t size = 0;
+  indexed_profile.storage = map_file(file_descriptor, size);
+  ::close(file_descriptor);
+  bool valid = indexed_profile.storage != nullptr and
+               size >= sizeof(shared_profile_magic) and
+               std::equal(shared_profile_magic,
+                          shared_profile_magic + sizeof(shared_profile_magic),
+                          indexed_profile.storage.get());
+  if (valid) {
+    ImageReader image(indexed_profile.storage.get() +
+                          sizeof(shared_profile_magic),
+                      size - sizeof(shared_profile_magic));
+    valid = read_indexed_profile(image, indexed_profile);
+  }
+  if (not valid) {
+    std::cerr << "Shared memory segment " << segment
+              << " does not contain a complete profile\n";
+    std::exit(1);
+  }
+  return indexed_profile;
+}
+
+/*!
+ * \brief Removes the named shared memory segment. Processes that have it
+ * mapped keep using it until they exit.
+ */
+void unlink_shared_profile(const std::string& name) {
+  const std::string segment = shared_memory_name(name);
+  if (::shm_unlink(segment.c_str()) != 0) {
+    std::cerr << "Could not remove shared memory segment: " << segment << "\n";
+    std::exit(1);
+  }
+}
+
+/*!
+ * \brief Returns whether the last byte of the first `bytes` bytes of the file
+ * is a newline
+ */
+bool ends_with_newline(const std::string& filename, const size_t bytes) {
+  if (bytes == 0) {
+    return true;
+  }
+  std::ifstream file(filename, std::ios::binary);
+  file.seekg(static_cast<std::streamoff>(bytes - 1));
+  return file.get() == '\n';
+}
+
+/*!
+ * \brief Describes the whole of the file for storing in a binary index. Only
+ * the metadata and the edges of the file are read, so this takes the same
+ * time for any file size, and `contents_hash` is left to the caller.
+ */
+IndexedInput describe_input(const std::string& filename) {
+  struct stat file_stat {};
+  if (::stat(filename.c_str(), &file_stat) != 0) {
+    std::cerr << "Could not open file: " << filename << " for reading\n";
+    std::exit(1);
+  }
+  const auto bytes = static_cast<size_t>(file_stat.st_size);
+#ifdef __linux__
+  const int64_t modification_time =
+      static_cast<int64_t>(file_stat.st_mtim.tv_sec) * 1000000000 +
+      file_stat.st_mtim.tv_nsec;
+#else
+  const int64_t modification_time =
+      static_cast<int64_t>(file_stat.st_mtime) * 1000000000;
+#endif
+  return IndexedInput{bytes, modification_time,
+                      hash_file_edges(filename, bytes), 0,
+                      ends_with_newline(filename, bytes)};
+}
+
+/*!
+ * \brief Adds the stacks and counts of `partial` to `profile`, replacing each
+ * frame ID `i` of `partial` by `frame_id_map[i]`. An empty `profile` takes the
+ * metrics of `partial`, otherwise they must be the same.
+ */
+void add_remapped_stacks(FoldedProfile& profile, const FoldedProfile& partial,
+                         const std::vector<uint32_t>& frame_id_map) {
+  if (partial.number_of_stacks() == 0) {
+    return;
+  }
+  if (profile.number_of_stacks() == 0 and
+      profile.metric_names != partial.metric_names) {
+    set_metric_names(profile, partial.metric_names);
+  }
+  if (profile.metric_names != partial.metric_names) {
+    throw std::invalid_argument(
+        "Cannot merge profiles with different metrics");
+  }
+  std::vector<uint32_t> frame_id_buffer{};
+  std::vector<double> value_buffer(partial.number_of_metrics());
+  for (size_t i = 0; i < partial.number_of_stacks(); ++i) {
+    frame_id_buffer.clear();
+    for (const uint32_t* frame = partial.stack_begin(i);
+         frame != partial.stack_end(i); ++frame) {
+      frame_id_buffer.push_back(frame_id_map[*frame]);
+    }
+    for (size_t metric = 0; metric < value_buffer.size(); ++metric) {
+      value_buffer[metric] = partial.metric_values(metric)[i];
+    }
+    add_stack(profile, frame_id_buffer.data(),
+              frame_id_buffer.data() + frame_id_buffer.size(),
+              value_buffer.data());
+  }
+}
+
+/*!
+ * \brief Adds the stacks and counts of `partial` to `profile`. The frame IDs of
+ * `partial` are remapped into the dictionary of `profile` once per distinct
+ * frame and identical stacks are joined through the hash lookup of
+ * `add_stack`, so no text is parsed.
+ */
+void merge_profile(FoldedProfile& profile, const FoldedProfile& partial) {
+  std::vector<uint32_t> frame_id_map(partial.frames.size());
+  for (size_t frame_id = 0; frame_id < partial.frames.size(); ++frame_id) {
+    frame_id_map[frame_id] = intern_frame(profile, partial.frames[frame_id]);
+  }
+  add_remapped_stacks(profile, partial, frame_id_map);
+}
+
+/*!
+ * \brief A stage of the stack rewriting pipeline. It rewrites one stack in
+ * place, given as frame IDs from the root to the lowest frame, and may intern
+ * new frames into the profile being built. Clearing the stack drops it.
+ */
+using StackStage = std::function<void(std::vector<uint32_t>& frame_ids)>;
+
+/*!
+ * \brief Stacks handed to the batch stages, laid out as in `fgf_stack_batch`:
+ * stack `i` has `stack_lengths[i]` frames from `stack_offsets[i]` in
+ * `frame_ids` and one value per metric from `i * number_of_metrics` in
+ * `values`
+ */
+struct StackBatch {
+  std::vector<uint32_t> frame_ids{};
+  std::vector<size_t> stack_offsets{};
+  std::vector<uint32_t> stack_lengths{};
+  std::vector<double> values{};
+};
+
+/*!
+ * \brief A stage of the stack rewriting pipeline that rewrites many stacks at
+ * once, in place, such as a plugin. A length of zero drops a stack.
+ */
+using BatchStage = std::function<void(StackBatch& batch)>;
+
+/*!
+ * \brief Returns a profile without stacks that has the frame dictionary and
+ * metrics of `profile`, for `rewrite_stacks` to add the rewritten stacks to
+ */
+FoldedProfile profile_with_frames_of(const FoldedProfile& profile) {
+  FoldedProfile rewritten{};
+  set_metric_names(rewritten, profile.metric_names);
+  rewritten.frames = profile.frames;
+  rewritten.frame_ids = profile.frame_ids;
+  return rewritten;
+}
+
+/*!
+ * \brief Adds the stacks of `profile` to `rewritten` with the stages applied
+ * to every stack in the order given, in a single pass over the stacks. The
+ * batch stages run after the stages, on batches of stacks.
+ *
+ * The stages work on frame IDs of `rewritten`, which must start out as
+ * `profile_with_frames_of(profile)`, so each stage looks at a distinct frame
+ * once and no intermediate profile is built. Stacks that become identical are
+ * merged by `add_stack` and empty stacks are dropped.
+ */
+void rewrite_stacks(const FoldedProfile& profile,
+                    const std::vector<StackStage>& stages,
+                    const std::vector<BatchStage>& batch_stages,
+                    FoldedProfile& rewritten) {
+  constexpr size_t stacks_per_batch = 4096;
+  const size_t number_of_metrics = profile.number_of_metrics();
+  StackBatch batch{};
+  const auto add_batch = [&batch_stages, &batch, &rewritten,
+                          &number_of_metrics]() {
+    for (const auto& stage : batch_stages) {
+      stage(batch);
+    }
+    for (size_t i = 0; i < batch.stack_offsets.size(); ++i) {
+      if (batch.stack_lengths[i] != 0) {
+        const uint32_t* const begin =
+            batch.frame_ids.data() + batch.stack_offsets[i];
+        add_stack(rewritten, begin, begin + batch.stack_lengths[i],
+                  batch.values.data() + i * number_of_metrics);
+      }
+    }
+    batch = StackBatch{};
+  };
+  std::vector<uint32_t> frame_id_buffer{};
+  std::vector<double> value_buffer(number_of_metrics);
+  for (size_t i = 0; i < profile.number_of_stacks(); ++i) {
+    frame_id_buffer.assign(profile.stack_begin(i), profile.stack_end(i));
+    for (const auto& stage : stages) {
+      if (frame_id_buffer.empty()) {
+        break;
+      }
+      stage(frame_id_buffer);
+    }
+    if (frame_id_buffer.empty()) {
+      continue;
+    }
+    for (size_t metric = 0; metric < value_buffer.size(); ++metric) {
+      value_buffer[metric] = profile.metric_values(metric)[i];
+    }
+    if (batch_stages.empty()) {
+      add_stack(rewritten, frame_id_buffer.data(),
+                frame_id_buffer.data() + frame_id_buffer.size(),
+                value_buffer.data());
+      continue;
+    }
+    batch.stack_offsets.push_back(batch.frame_ids.size());
+    batch.stack_lengths.push_back(
+        static_cast<uint32_t>(frame_id_buffer.size()));
+    batch.frame_ids.insert(batch.frame_ids.end(), frame_id_buffer.begin(),
+                           frame_id_buffer.end());
+    batch.values.insert(batch.values.end(), value_buffer.begin(),
+                        value_buffer.end());
+    if (batch.stack_offsets.size() == stacks_per_batch) {
+      add_batch();
+    }
+  }
+  if (not batch.stack_offsets.empty()) {
+    add_batch();
+  }
+}
+
+/*!
+ * \brief Returns the stage that removes the frames of the kinds in `drop` and
+ * replaces each run of consecutive frames of one of the kinds in `collapse`
+ * by the first, outermost, frame of the run. The annotation of each distinct
+ * frame is parsed once.
+ */
+StackStage frame_kind_stage(const FoldedProfile& rewritten, const uint8_t drop,
+                            const uint8_t collapse) {
+  std::vector<uint8_t> frame_kinds{};
+  return [&rewritten, drop, collapse,
+          frame_kinds](std::vector<uint32_t>& frame_ids) mutable {
+    // Kinds fit in four bits, so this marks frames not looked at yet
+    const uint8_t unknown_kind = 0xff;
+    size_t number_kept = 0;
+    uint8_t previous_kind = 0;
+    for (const auto frame_id : frame_ids) {
+      if (frame_id >= frame_kinds.size()) {
+        frame_kinds.resize(rewritten.frames.size(), unknown_kind);
+      }
+      if (frame_kinds[frame_id] == unknown_kind) {
+        frame_kinds[frame_id] = frame_kind::of(rewritten.frames[frame_id]);
+      }
+      const uint8_t kind = frame_kinds[frame_id];
+      if ((kind & drop) != 0) {
+        continue;
+      }
+      if ((kind & collapse) == 0 or kind != previous_kind) {
+        frame_ids[number_kept++] = frame_id;
+      }
+      previous_kind = kind;
+    }
+    frame_ids.resize(number_kept);
+  };
+}
+
+/*!
+ * \brief Returns the root frame `comm-pid/tid`, as written for `perf` profiles
+ * recorded per thread, reduced to the process, `comm-pid`, if `normalization`
+ * is `process`, or to the command, `comm`, if it is `command`. Other frames
+ * are returned unchanged.
+ */
+std::string normalized_root_frame(std::string frame,
+                                  const std::string& normalization) {
+  const auto is_number_from = [&frame](const size_t begin) {
+    return begin < frame.size() and
+           std::all_of(frame.begin() + static_cast<std::ptrdiff_t>(begin),
+                       frame.end(),
+                       [](const char c) { return c >= '0' and c <= '9'; });
+  };
+  const auto slash = frame.rfind('/');
+  if (slash != std::string::npos and is_number_from(slash + 1)) {
+    frame.resize(slash);
+  }
+  const auto dash = frame.rfind('-');
+  if (normalization == "command" and dash != std::string::npos and
+      dash > 0 and is_number_from(dash + 1)) {
+    frame.resize(dash);
+  }
+  return frame;
+}
+
+/*!
+ * \brief Returns the stage that normalizes the root frame of every stack by
+ * `normalized_root_frame`, merging the stacks of the threads of a process or
+ * of all processes running a command. Each distinct root frame is only
+ * normalized once.
+ */
+StackStage root_frame_stage(FoldedProfile& rewritten,
+                            const std::string& normalization) {
+  if (normalization != "process" and normalization != "command") {
+    throw std::invalid_argument("Unknown root frame normalization '" +
+                                normalization +
+                                "', expected process or command");
+  }
+  std::unordered_map<uint32_t, uint32_t> normalized_roots{};
+  return [&rewritten, normalization,
+          normalized_roots](std::vector<uint32_t>& frame_ids) mutable {
+    auto root = normalized_roots.find(frame_ids.front());
+    if (root == normalized_roots.end()) {
+      root = normalized_roots
+                 .emplace(frame_ids.front(),
+                          intern_frame(rewritten,
+                                       normalized_root_frame(
+                                           rewritten.frames[frame_ids.front()],
+                                           normalization)))
+                 .first;
+    }
+    frame_ids.front() = root->second;
+  };
+}
+
+/*!
+ * \brief Returns the stage that applies the `--rename` rules,
+ * `REGEX=REPLACEMENT`, in order to every frame name.
+ *
+ * Every match of the regular expression in a frame name is replaced, where the
+ * replacement may refer to groups as `$1`. Use `\=` for a literal `=` in the
+ * regular expression. The rules are run once per distinct frame.
+ */
+StackStage rename_stage(FoldedProfile& rewritten,
+                        const std::vector<std::string>& rules) {
+  std::vector<std::pair<std::regex, std::string>> substitutions{};
+  for (const auto& rule : rules) {
+    size_t separator = rule.find('=');
+    while (separator != std::string::npos and separator > 0 and
+           rule[separator - 1] == '\\') {
+      separator = rule.find('=', separator + 1);
+    }
+    if (separator == std::string::npos) {
+      throw std::invalid_argument("Rename rule '" + rule +
+                                  "' is not of the form REGEX=REPLACEMENT");
+    }
+    substitutions.emplace_back(std::regex(rule.substr(0, separator)),
+                               rule.substr(separator + 1));
+  }
+  std::vector<uint32_t> renamed_frame_ids{};
+  return [&rewritten, substitutions,
+          renamed_frame_ids](std::vector<uint32_t>& frame_ids) mutable {
+    const uint32_t unknown_frame = std::numeric_limits<uint32_t>::max();
+    std::string frame{};
+    for (auto& frame_id : frame_ids) {
+      if (frame_id >= renamed_frame_ids.size()) {
+        renamed_frame_ids.resize(rewritten.frames.size(), unknown_frame);
+      }
+      if (renamed_frame_ids[frame_id] == unknown_frame) {
+        frame = rewritten.frames[frame_id].str();
+        for (const auto& substitution : substitutions) {
+          frame = std::regex_replace(frame, substitution.first,
+                                     substitution.second);
+        }
+        renamed_frame_ids[frame_id] = intern_frame(rewritten, frame);
+      }
+      frame_id = renamed_frame_ids[frame_id];
+    }
+  };
+}
+
+/*!
+ * \brief A batch stage loaded from a shared library through the interface in
+ * `flamegraph_filter_plugin.h`, given as `LIBRARY[=ARGUMENT]`.
+ *
+ * The plugin sees the frame dictionary of `rewritten`, which must outlive it,
+ * and its output is checked so that a faulty plugin cannot corrupt the
+ * profile.
+ */
+class StagePlugin {
+ public:
+  StagePlugin(FoldedProfile& rewritten, const std::string& option)
+      : library_(option.substr(0, option.find('='))) {
+    const std::string argument = option.find('=') == std::string::npos
+                                     ? std::string{}
+                                     : option.substr(option.find('=') + 1);
+    handle_ = ::dlopen(library_.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (handle_ == nullptr) {
+      throw std::invalid_argument("Could not load plugin " + library_ + ": " +
+                                  ::dlerror());
+    }
+    const auto entry = reinterpret_cast<fgf_stage_plugin_entry_function>(
+        ::dlsym(handle_, FGF_STAGE_PLUGIN_ENTRY));
+    plugin_ = entry != nullptr ? entry() : nullptr;
+    if (plugin_ == nullptr or plugin_->abi_version == 0 or
+        plugin_->abi_version > FGF_PLUGIN_ABI_VERSION) {
+      ::dlclose(handle_);
+      throw std::invalid_argument(
+          "Plugin " + library_ + " does not export " + FGF_STAGE_PLUGIN_ENTRY +
+          " for interface version " + std::to_string(FGF_PLUGIN_ABI_VERSION) +
+          " or lower");
+    }
+    host_.abi_version = FGF_PLUGIN_ABI_VERSION;
+    host_.context = &rewritten;
+    host_.number_of_frames = &number_of_frames;
+    host_.frame_name = &frame_name;
+    host_.intern_frame = &intern;
+    state_ = plugin_->create(&host_, argument.c_str());
+    if (state_ == nullptr) {
+      ::dlclose(handle_);
+      throw std::invalid_argument("Plugin " + library_ +
+                                  " failed to start with argument '" +
+                                  argument + "'");
+    }
+  }
+
+  StagePlugin(const StagePlugin&) = delete;
+  StagePlugin& operator=(const StagePlugin&) = delete;
+
+  ~StagePlugin() {
+    plugin_->destroy(state_);
+    ::dlclose(handle_);
+  }
+
+  /// Hands the batch to the plugin, throwing if it fails or returns frames
+  /// that are not in the dictionary or stacks longer than they were
+  void process(StackBatch& batch) {
+    const auto lengths = batch.stack_lengths;
+    fgf_stack_batch plugin_batch{};
+    plugin_batch.number_of_stacks = batch.stack_offsets.size();
+    plugin_batch.frame_ids = batch.frame_ids.data();
+    plugin_batch.stack_offsets = batch.stack_offsets.data();
+    plugin_batch.stack_lengths = batch.stack_lengths.data();
+    plugin_batch.number_of_metrics =
+        batch.stack_offsets.empty()
+            ? 0
+            : batch.values.size() / batch.stack_offsets.size();
+    plugin_batch.values = batch.values.data();
+    if (plugin_->process_batch(state_, &plugin_batch) != 0) {
+      throw std::runtime_error("Plugin " + library_ +
+                               " failed to process the stacks");
+    }
+    const auto& frames = static_cast<FoldedProfile*>(host_.context)->frames;
+    for (size_t i = 0; i < lengths.size(); ++i) {
+      if (batch.stack_lengths[i] > lengths[i] or
+          std::any_of(batch.frame_ids.begin() +
+                          static_cast<std::ptrdiff_t>(batch.stack_offsets[i]),
+                      batch.frame_ids.begin() +
+                          static_cast<std::ptrdiff_t>(batch.stack_offsets[i] +
+                                                      batch.stack_lengths[i]),
+                      [&frames](const uint32_t frame_id) {
+                        return frame_id >= frames.size();
+                      })) {
+        throw std::runtime_error("Plugin " + library_ +
+                                 " returned an invalid stack");
+      }
+    }
+  }
+
+ private:
+  static uint32_t number_of_frames(void* const context) {
+    return static_cast<uint32_t>(
+        static_cast<FoldedProfile*>(context)->frames.size());
+  }
+
+  static const char* frame_name(void* const context, const uint32_t frame_id,
+                                size_t* const length) {
+    const auto& frames = static_cast<FoldedProfile*>(context)->frames;
+    if (frame_id >= frames.size()) {
+      *length = 0;
+      return nullptr;
+    }
+    *length = frames[frame_id].size();
+    return frames[frame_id].data();
+  }
+
+  static uint32_t intern(void* const context, const char* const name,
+                         const size_t length) {
+    return intern_frame(*static_cast<FoldedProfile*>(context),
+                        std::string(name, length));
+  }
+
+  std::string library_;
+  void* handle_ = nullptr;
+  const fgf_stage_plugin* plugin_ = nullptr;
+  fgf_host host_{};
+  void* state_ = nullptr;
+};
+
+/*!
+ * \brief Writes `profile` to the file descriptor in the format of
+ * `write_profile`, returning false on failure
+ */
+bool write_profile_to(const int file_descriptor, const FoldedProfile& profile) {
+  FileDescriptorBuffer buffer(file_descriptor);
+  std::ostream os(&buffer);
+  write_profile(os, profile);
+  os.flush();
+  return not buffer.failed() and static_cast<bool>(os);
+}
+
+/*!
+ * \brief Reads everything from the file descriptor until end of file
+ */
+std::string read_all(const int file_descriptor) {
+  std::string data{};
+  std::vector<char> buffer(size_t{1} << 20);
+  ssize_t bytes_read = 0;
+  while ((bytes_read = ::read(file_descriptor, buffer.data(), buffer.size())) >
+         0) {
+    data.append(buffer.data(), static_cast<size_t>(bytes_read));
+  }
+  return data;
+}
+
+/*!
+ * \brief Splits the files into `number_of_shards` shards of similar total
+ * size, assigning the largest files first to the smallest shard
+ */
+std::vector<std::vector<std::string>> shard_files(
+    const std::vector<std::string>& filenames, const size_t number_of_shards) {
+  std::vector<std::pair<size_t, std::string>> files_by_size{};
+  for (const auto& filename : filenames) {
+    files_by_size.emplace_back(get_file_size(filename), filename);
+  }
+  std::stable_sort(files_by_size.begin(), files_by_size.end(),
+                   [](const std::pair<size_t, std::string>& a,
+                      const std::pair<size_t, std::string>& b) {
+                     return a.first > b.first;
+                   });
+  std::vector<std::vector<std::string>> shards(number_of_shards);
+  std::vector<size_t> shard_bytes(number_of_shards, 0);
+  for (const auto& file : files_by_size) {
+    const auto smallest = static_cast<size_t>(
+        std::min_element(shard_bytes.begin(), shard_bytes.end()) -
+        shard_bytes.begin());
+    shards[smallest].push_back(file.second);
+    shard_bytes[smallest] += file.first;
+  }
+  return shards;
+}
+
+/*!
+ * \brief Returns the CPUs of each NUMA node, or nothing if the topology cannot
+ * be read from sysfs
+ */
+std::vector<std::vector<int>> numa_node_cpus() {
+  std::vector<std::vector<int>> node_cpus{};
+#ifdef __linux__
+  for (size_t node = 0;; ++node) {
+    std::ifstream cpu_list_file("/sys/devices/system/node/node" +
+                                std::to_string(node) + "/cpulist");
+    if (not cpu_list_file.is_open()) {
+      break;
+    }
+    // The list looks like "0-3,8-11"
+    std::vector<int> cpus{};
+    std::string range{};
+    while (std::getline(cpu_list_file, range, ',')) {
+      const auto dash = range.find('-');
+      const int first = std::atoi(range.c_str());
+      const int last = dash == std::string::npos
+                           ? first
+                           : std::atoi(range.c_str() + dash + 1);
+      for (int cpu = first; cpu <= last and not range.empty(); ++cpu) {
+        cpus.push_back(cpu);
+      }
+    }
+    node_cpus.push_back(cpus);
+  }
+#endif
+  return node_cpus;
+}
+
+/*!
+ * \brief Restricts the calling process to the CPUs of the NUMA node and makes
+ * the node its preferred node for memory, so that the buffers and tables it
+ * allocates from now on are local. Does nothing if there are fewer than two
+ * nodes.
+ */
+void bind_to_numa_node(const std::vector<std::vector<int>>& node_cpus,
+                       const size_t node) {
+#ifdef __linux__
+  if (node_cpus.size() < 2 or node_cpus[node].empty()) {
+    return;
+  }
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  for (const int cpu : node_cpus[node]) {
+    CPU_SET(cpu, &cpu_set);
+  }
+  if (::sched_setaffinity(0, sizeof(cpu_set), &cpu_set) != 0) {
+    std::cerr << "Could not bind to the CPUs of NUMA node " << node << "\n";
+  }
+  unsigned long node_mask[16] = {};
+  if (node < 8 * sizeof(node_mask)) {
+    node_mask[node / (8 * sizeof(unsigned long))] |=
+        1UL << (node % (8 * sizeof(unsigned long)));
+    if (::syscall(SYS_set_mempolicy, MPOL_PREFERRED, node_mask,
+                  8 * sizeof(node_mask)) != 0) {
+      std::cerr << "Could not prefer the memory of NUMA node " << node
+                << "\n";
+    }
+  }
+#else
+  (void)node_cpus;
+  (void)node;
+#endif
+}
+
+/*!
+ * \brief Saves the CPU affinity and memory policy of the calling process and
+ * restores them when destroyed, so that a process can be bound to a NUMA node
+ * for a while
+ */
+class SavedNumaPlacement {
+ public:
+  SavedNumaPlacement() {
+#ifdef __linux__
+    saved_cpus_ =
+        ::sched_getaffinity(0, sizeof(cpu_set_), &cpu_set_) == 0;
+    saved_memory_policy_ =
+        ::syscall(SYS_get_mempolicy, &memory_policy_, node_mask_,
+                  8 * sizeof(node_mask_), nullptr, 0) == 0;
+#endif
+  }
+
+  SavedNumaPlacement(const SavedNumaPlacement&) = delete;
+  SavedNumaPlacement& operator=(const SavedNumaPlacement&) = delete;
+
+  ~SavedNumaPlacement() {
+#ifdef __linux__
+    if (saved_cpus_) {
+      ::sched_setaffinity(0, sizeof(cpu_set_), &cpu_set_);
+    }
+    if (saved_memory_policy_) {
+      ::syscall(SYS_set_mempolicy, memory_policy_, node_mask_,
+                8 * sizeof(node_mask_));
+    }
+#endif
+  }
+
+ private:
+#ifdef __linux__
+  cpu_set_t cpu_set_{};
+  int memory_policy_ = MPOL_DEFAULT;
+  unsigned long node_mask_[16] = {};
+  bool saved_cpus_ = false;
+  bool saved_memory_policy_ = false;
+#endif
+};
+
+/*!
+ * \brief Aggregates the folded files with `jobs` processes and returns the
+ * merged profile.
+ *
+ * Each process parses one shard of the files into a partial profile. The
+ * partials are then merged in a binary tree: in round `r` the process with
+ * rank `i`, where `i` is a multiple of `2^(r+1)`, receives the partial of rank
+ * `i + 2^r` through a pipe and merges it into its own. Rank 0 is the calling
+ * process and ends up with the full profile after `log2(jobs)` rounds, as it
+ * would when reducing over the nodes of a cluster. The value columns of the
+ * files are the metrics `metric_names`.
+ *
+ * If `numa_aware` is true rank `i` is bound to NUMA node `i % nodes` before it
+ * allocates anything, so each partial profile lives on the node that builds
+ * it and memory only crosses nodes when partials are sent to be merged. The
+ * calling process gets its CPU affinity and memory policy back once the
+ * reduction is done.
+ */
+FoldedProfile aggregate_folded_files(
+    const std::vector<std::string>& filenames, size_t jobs,
+    const std::vector<std::string>& metric_names, const bool numa_aware) {
+  jobs = std::max(size_t{1}, std::min(jobs, filenames.size()));
+  const auto shards = shard_files(filenames, jobs);
+  // pipes[i] carries the partial of rank i to the rank that merges it
+  std::vector<std::array<int, 2>> pipes(jobs, std::array<int, 2>{{-1, -1}});
+  for (size_t rank = 1; rank < jobs; ++rank) {
+    if (::pipe(pipes[rank].data()) != 0) {
+      std::cerr << "Could not create a pipe for the worker processes\n";
+      std::exit(1);
+    }
+  }
+
+  const auto node_cpus =
+      numa_aware ? numa_node_cpus() : std::vector<std::vector<int>>{};
+  const auto aggregate_and_reduce = [&pipes, &shards, &jobs, &node_cpus,
+                                     &metric_names](const size_t rank) {
+    if (not node_cpus.empty()) {
+      bind_to_numa_node(node_cpus, rank % node_cpus.size());
+    }
+    // Only keep the pipe ends this rank uses so that reads see end of file
+    // once the sending rank is done
+    for (size_t other = 1; other < jobs; ++other) {
+      if (other != rank) {
+        ::close(pipes[other][1]);
+      }
+    }
+    FoldedProfile profile{};
+    set_metric_names(profile, metric_names);
+    for (const auto& filename : shards[rank]) {
+      parse_folded_file(profile, filename);
+    }
+    for (size_t stride = 1; stride < jobs and rank % (2 * stride) == 0;
+         stride *= 2) {
+      const size_t partner = rank + stride;
+      if (partner >= jobs) {
+        continue;
+      }
+      const std::string image = read_all(pipes[partner][0]);
+      ::close(pipes[partner][0]);
+      ImageReader reader(image.data(), image.size());
+      FoldedProfile partial{};
+      if (not read_profile(reader, partial)) {
+        std::cerr << "Received an incomplete partial profile from worker "
+                  << partner << "\n";
+        std::exit(1);
+      }
+      merge_profile(profile, partial);
+    }
+    return profile;
+  };
+
+  // The workers add the bytes they parse to a counter in shared memory, so
+  // that the --progress monitor of this process sees them
+  std::atomic<size_t>* const own_progress = progress::bytes_processed;
+  void* const shared_progress =
+      jobs > 1 ? ::mmap(nullptr, sizeof(std::atomic<size_t>),
+                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                        -1, 0)
+               : MAP_FAILED;
+  std::vector<pid_t> workers{};
+  {
+    // The monitor thread must not be printing a report, and so hold locks of
+    // the standard library, while the process forks
+    std::lock_guard<std::mutex> report_lock(progress::report_mutex);
+    if (shared_progress != MAP_FAILED) {
+      progress::bytes_processed = new (shared_progress)
+          std::atomic<size_t>(own_progress->load(std::memory_order_relaxed));
+    }
+    for (size_t rank = 1; rank < jobs; ++rank) {
+      const pid_t pid = ::fork();
+      if (pid < 0) {
+        std::cerr << "Could not start worker process " << rank << "\n";
+        std::exit(1);
+      }
+      if (pid == 0) {
+        const FoldedProfile profile = aggregate_and_reduce(rank);
+        const bool written = write_profile_to(pipes[rank][1], profile);
+        ::close(pipes[rank][1]);
+        std::_Exit(written ? 0 : 1);
+      }
+      workers.push_back(pid);
+    }
+  }
+  FoldedProfile profile{};
+  if (node_cpus.empty()) {
+    profile = aggregate_and_reduce(0);
+  } else {
+    const SavedNumaPlacement placement{};
+    profile = aggregate_and_reduce(0);
+  }
+  bool workers_succeeded = true;
+  for (const auto pid : workers) {
+    int status = 0;
+    ::waitpid(pid, &status, 0);
+    workers_succeeded &= WIFEXITED(status) and WEXITSTATUS(status) == 0;
+  }
+  if (shared_progress != MAP_FAILED) {
+    std::lock_guard<std::mutex> report_lock(progress::report_mutex);
+    own_progress->store(progress::bytes_processed->load(),
+                        std::memory_order_relaxed);
+    progress::bytes_processed = own_progress;
+    ::munmap(shared_progress, sizeof(std::atomic<size_t>));
+  }
+  if (not workers_succeeded) {
+    std::cerr << "A worker process failed\n";
+    std::exit(1);
+  }
+  return profile;
+}
+
+constexpr char partial_profile_magic[8] = {'F', 'G', 'F', 'P',
+                                           'R', 'T', '0', '3'};
+
+/*!
+ * \brief Writes the profile as a partial result that can be merged with other
+ * partials by `--merge-partials`.
+ *
+ * As with `write_index`, the partial is written to a temporary file that is
+ * renamed once complete, so a failed write does not leave a truncated partial.
+ */
+void write_partial_profile(const std::string& partial_filename,
+                           const FoldedProfile& profile) {
+  const std::string temporary_filename =
+      partial_filename + ".tmp." + std::to_string(::getpid());
+  std::ofstream partial_file(temporary_filename, std::ios::binary);
+  if (not partial_file.is_open()) {
+    std::cerr << "Could not open file: " << temporary_filename
+              << " for writing\n";
+    std::exit(1);
+  }
+  partial_file.write(partial_profile_magic, sizeof(partial_profile_magic));
+  write_profile(partial_file, profile);
+  partial_file.close();
+  if (not partial_file or std::rename(temporary_filename.c_str(),
+                                      partial_filename.c_str()) != 0) {
+    std::remove(temporary_filename.c_str());
+    std::cerr << "Could not write partial profile: " << partial_filename
+              << "\n";
+    std::exit(1);
+  }
+}
+
+/*!
+ * \brief Merges the partial results written by `write_partial_profile` into
+ * `profile`.
+ *
+ * Each partial is memory mapped and merged by remapping its dictionary into
+ * that of `profile`, so the order in which partials are merged, and whether
+ * they were themselves merged from other partials, does not change the
+ * sample counts of the result.
+ */
+void merge_partial_profiles(FoldedProfile& profile,
+                            const std::vector<std::string>& partial_filenames) {
+  for (const auto& partial_filename : partial_filenames) {
+    const int file_descriptor = ::open(partial_filename.c_str(), O_RDONLY);
+    size_t size = 0;
+    const auto mapping =
+        file_descriptor < 0 ? nullptr : map_file(file_descriptor, size);
+    if (file_descriptor >= 0) {
+      ::close(file_descriptor);
+    }
+    FoldedProfile partial{};
+    bool valid =
+        mapping != nullptr and size >= sizeof(partial_profile_magic) and
+        std::equal(partial_profile_magic,
+                   partial_profile_magic + sizeof(partial_profile_magic),
+                   mapping.get());
+    if (valid) {
+      ImageReader image(mapping.get() + sizeof(partial_profile_magic),
+                        size - sizeof(partial_profile_magic));
+      valid = read_profile(image, partial);
+    }
+    if (not valid) {
+      std::cerr << "Could not read partial result: " << partial_filename
+                << "\n";
+      std::exit(1);
+    }
+    merge_profile(profile, partial);
+  }
+}
+
+/*!
+ * \brief Loads the profile of `input_filename` and its derived indexes from
+ * the binary index, updating the index first if needed.
+ *
+ * The index is up to date if the input has the size, modification time, and
+ * first and last bytes it was built from, so checking it does not read the
+ * input. If the input is longer, it is hashed in full, and if its prefix has
+ * the hash of the indexed bytes, i.e. lines were only appended, just the
+ * appended lines are parsed and merged into the dictionary, counts, and
+ * derived indexes. Otherwise, or if the index has other metrics than
+ * `metric_names`, the input is parsed in full.
+ */
+IndexedProfile load_indexed_profile(
+    const std::string& input_filename, const std::string& index_filename,
+    const std::vector<std::string>& metric_names) {
+  IndexedInput input = describe_input(input_filename);
+  IndexedProfile indexed_profile{};
+  IndexedInput indexed_input{0, 0, 0, 0, false};
+  if (read_index(index_filename, indexed_input, indexed_profile) and
+      indexed_profile.profile.metric_names == metric_names) {
+    if (indexed_input.bytes == input.bytes and
+        indexed_input.modification_time == input.modification_time and
+        indexed_input.hash == input.hash) {
+      return indexed_profile;
+    }
+    uint64_t prefix_hash = 0;
+    if (indexed_input.bytes < input.bytes and
+        indexed_input.ends_with_newline) {
+      input.contents_hash = hash_file(input_filename, input.bytes,
+                                      indexed_input.bytes, &prefix_hash);
+    }
+    if (indexed_input.bytes < input.bytes and
+        indexed_input.ends_with_newline and
+        prefix_hash == indexed_input.contents_hash) {
+      auto& profile = indexed_profile.profile;
+      const size_t first_new_stack = profile.number_of_stacks();
+      // Refers to the mapped index, so this does not copy the counts
+      const SharedArray<double> previous_counts = profile.sample_counts;
+      parse_folded_file(profile, input_filename, indexed_input.bytes,
+                        input.bytes);
+      update_derived_indexes(indexed_profile, first_new_stack,
+                             previous_counts);
+      write_index(index_filename, input, indexed_profile);
+      return indexed_profile;
+    }
+  }
+  indexed_profile = IndexedProfile{};
+  set_metric_names(indexed_profile.profile, metric_names);
+  parse_folded_file(indexed_profile.profile, input_filename, 0, input.bytes);
+  build_derived_indexes(indexed_profile);
+  input.contents_hash = hash_file(input_filename, input.bytes);
+  write_index(index_filename, input, indexed_profile);
+  return indexed_profile;
+}
+
+/*!
+ * \brief Loads the profile and its derived indexes from the `--shm` segment or
+ * `--index` if one is given, otherwise by merging the `--merge-partials` and
+ * parsing the input files
+ */
+IndexedProfile load_profile(const po::variables_map& args) {
+  std::vector<std::string> rename_rules{};
+  if (args.count("rename")) {
+    rename_rules = args["rename"].as<std::vector<std::string>>();
+  }
+  const auto metric_names = get_metric_names(args);
+  // The index and shared profile keep the original stacks and metric order,
+  // so filtering frame kinds, normalizing root frames, renaming frames, or
+  // selecting another metric requires new derived indexes
+  const uint8_t frame_kinds_to_drop =
+      (args.count("drop-frames")
+           ? frame_kind::parse(args["drop-frames"].as<std::string>())
+           : 0) |
+      (args.count("keep-only-frames")
+           ? static_cast<uint8_t>(~frame_kind::parse(
+                 args["keep-only-frames"].as<std::string>()))
+           : 0);
+  const uint8_t frame_kinds_to_collapse =
+      args.count("collapse-frames")
+          ? frame_kind::parse(args["collapse-frames"].as<std::string>())
+          : 0;
+  const auto prepared_profile = [&rename_rules, &args, &frame_kinds_to_drop,
+                                 &frame_kinds_to_collapse](
+                                    IndexedProfile indexed_profile,
+                                    const bool has_derived_indexes) {
+    // The stages are declared in order and fused into one pass over the
+    // stacks, which builds the rewritten profile. Stages may add frames to
+    // its dictionary as soon as they are created. Only the rewrites are
+    // stages: selecting, cutting off, limiting, and writing stacks work on
+    // sets of stack IDs through the derived indexes built below.
+    FoldedProfile rewritten{};
+    if (frame_kinds_to_drop != 0 or frame_kinds_to_collapse != 0 or
+        args.count("normalize-root-frames") or not rename_rules.empty() or
+        args.count("plugin")) {
+      rewritten = profile_with_frames_of(indexed_profile.profile);
+    }
+    std::vector<StackStage> stages{};
+    if (frame_kinds_to_drop != 0 or frame_kinds_to_collapse != 0) {
+      stages.push_back(frame_kind_stage(rewritten, frame_kinds_to_drop,
+                                        frame_kinds_to_collapse));
+    }
+    if (args.count("normalize-root-frames")) {
+      stages.push_back(root_frame_stage(
+          rewritten, args["normalize-root-frames"].as<std::string>()));
+    }
+    if (not rename_rules.empty()) {
+      stages.push_back(rename_stage(rewritten, rename_rules));
+    }
+    std::vector<BatchStage> batch_stages{};
+    if (args.count("plugin")) {
+      for (const auto& option :
+           args["plugin"].as<std::vector<std::string>>()) {
+        const std::shared_ptr<StagePlugin> plugin =
+            std::make_shared<StagePlugin>(rewritten, option);
+        batch_stages.push_back(
+            [plugin](StackBatch& batch) { plugin->process(batch); });
+      }
+    }
+    const bool frames_changed = not stages.empty() or not batch_stages.empty();
+    if (frames_changed) {
+      rewrite_stacks(indexed_profile.profile, stages, batch_stages,
+                     rewritten);
+      indexed_profile = IndexedProfile{};
+      indexed_profile.profile = std::move(rewritten);
+    }
+    size_t ratio_metric = 0;
+    const bool metric_changed =
+        args.count("metric") and
+        select_metric(indexed_profile.profile,
+                      args["metric"].as<std::string>(), ratio_metric);
+    if (frames_changed or not has_derived_indexes) {
+      build_derived_indexes(indexed_profile);
+    } else if (metric_changed) {
+      std::vector<uint32_t> all_stack_ids(
+          indexed_profile.profile.number_of_stacks());
+      std::iota(all_stack_ids.begin(), all_stack_ids.end(), uint32_t{0});
+      indexed_profile.leaf_tree =
+          build_leaf_tree(indexed_profile.profile, all_stack_ids);
+    }
+    indexed_profile.ratio_metric = ratio_metric;
+    if (args.count("sort")) {
+      indexed_profile.output_order =
+          parse_output_order(args["sort"].as<std::string>());
+    }
+    return indexed_profile;
+  };
+  if (args.count("shm")) {
+    return prepared_profile(map_shared_profile(args["shm"].as<std::string>()),
+                            true);
+  }
+  const auto filenames = get_input_filenames(args);
+  if (args.count("index")) {
+    if (filenames.size() != 1) {
+      std::cerr << "--index requires exactly one input file\n";
+      std::exit(1);
+    }
+    return prepared_profile(
+        load_indexed_profile(filenames.front(),
+                             args["index"].as<std::string>(), metric_names),
+        true);
+  }
+  IndexedProfile indexed_profile{};
+  if (args.count("merge-partials")) {
+    merge_partial_profiles(
+        indexed_profile.profile,
+        args["merge-partials"].as<std::vector<std::string>>());
+  }
+  if (not filenames.empty()) {
+    merge_profile(indexed_profile.profile,
+                  aggregate_folded_files(filenames, args["jobs"].as<size_t>(),
+                                         metric_names, args.count("numa")));
+  }
+  return prepared_profile(std::move(indexed_profile), false);
+}
+
+/*!
+ * \brief Clears `frame_is_shown` for the lowest frames whose samples summed
+ * over the stacks in `stack_ids` are not a percentage of `total_samples`
+ * greater than the cutoff percentage
  */
-template <class T>
-std::ostream& operator<<(std::ostream& os, const std::vector<T>& v) {
-  os << "(";
-  std::copy(v.begin(), std::prev(v.end()), std::ostream_iterator<T>(os, ", "));
-  os << v.back() << ")";
-  return os;
+void apply_cutoff(const FoldedProfile& profile,
+                  const std::vector<uint32_t>& stack_ids,
+                  const double cutoff_percentage, const double total_samples,
+                  std::vector<char>& frame_is_shown) {
+  std::vector<double> lowest_frame_samples(profile.frames.size(), 0.0);
+  for (const auto stack_id : stack_ids) {
+    lowest_frame_samples[profile.lowest_frame(stack_id)] +=
+        profile.sample_counts[stack_id];
+  }
+  for (size_t frame_id = 0; frame_id < profile.frames.size(); ++frame_id) {
+    if (lowest_frame_samples[frame_id] == 0 or
+        not(lowest_frame_samples[frame_id] / total_samples >
+            0.01 * cutoff_percentage)) {
+      frame_is_shown[frame_id] = 0;
+    }
+  }
 }
 
 /*!
- * \brief Returns the lowest stack frame. Specifically, if the sample is
- * collected in: `main()->foo()->bar()->baz()` it will return `baz`
+ * \brief Returns, for each frame ID, whether stacks with that lowest frame are
+ * shown. That is, whether the samples of the frame summed over the stacks in
+ * `stack_ids` are a percentage of the total samples greater than the cutoff
+ * percentage and the frame matches one of the regular expressions, if any are
+ * given. Each regular expression is only run once per distinct lowest frame.
+ *
+ * The percentage is always of all the samples in the profile.
  */
-std::string get_lowest_stack(const std::string& full_stack_and_sample_count) {
-  const auto location_of_last_semicolon =
-      full_stack_and_sample_count.find_last_of(';') + 1;
-  return full_stack_and_sample_count.substr(
-      location_of_last_semicolon,
-      full_stack_and_sample_count.find_last_of(' ') -
-          location_of_last_semicolon);
+std::vector<char> shown_lowest_frames(
+    const FoldedProfile& profile, FrameMatcher& frame_matcher,
+    const std::vector<uint32_t>& stack_ids, const double cutoff_percentage,
+    const std::vector<std::string>& regexes_to_show) {
+  std::vector<char> frame_is_shown =
+      regexes_to_show.empty()
+          ? std::vector<char>(profile.frames.size(), 1)
+          : frame_matcher.matches_any(regexes_to_show);
+  apply_cutoff(profile, stack_ids, cutoff_percentage,
+               std::accumulate(profile.sample_counts.begin(),
+                               profile.sample_counts.end(), 0.0),
+               frame_is_shown);
+  return frame_is_shown;
 }
 
 /*!
- * \brief Returns the number of samples collected for the specific stack trace
+ * \brief Returns the IDs of the stacks out of `stack_ids` whose lowest frame
+ * is shown according to `shown_lowest_frames`. This is the filter of
+ * `write_filtered_stack_map` for a `FoldedProfile`.
+ *
+ * The stacks are ordered by the name of their lowest frame and then by their
+ * first appearance in the input, which is the order `write_filtered_stack_map`
+ * writes.
  */
-size_t get_sample_count(const std::string& full_stack_and_sample_count) {
-  return std::atoi(full_stack_and_sample_count
-                       .substr(full_stack_and_sample_count.find_last_of(' '))
-                       .c_str());
+std::vector<uint32_t> filter_profile(const FoldedProfile& profile,
+                                     const std::vector<uint32_t>& stack_ids,
+                                     const std::vector<char>& frame_is_shown) {
+  std::vector<uint32_t> filtered_stack_ids{};
+  for (const auto stack_id : stack_ids) {
+    if (frame_is_shown[profile.lowest_frame(stack_id)]) {
+      filtered_stack_ids.push_back(stack_id);
+    }
+  }
+  std::stable_sort(filtered_stack_ids.begin(), filtered_stack_ids.end(),
+                   [&profile](const uint32_t a, const uint32_t b) {
+                     return profile.frames[profile.lowest_frame(a)] <
+                            profile.frames[profile.lowest_frame(b)];
+                   });
+  return filtered_stack_ids;
 }
 
 /*!
- * \brief Builds a map between the lowest stack frame and a pair of the total
- * samples of that lowest stack frame and a vector of the stack trace
+ * \brief Writes the given stacks of the profile as folded lines, keeping only
+ * the lowest `stack_limit` frames of each stack if `stack_limit` is non-zero.
+ * If `ratio_metric` is non-zero the value of each line is the ratio of that
+ * metric to the first one, and stacks where the first metric is zero are
+ * skipped as they are when writing a leaf tree.
  */
-std::map<std::string, std::tuple<size_t, std::vector<std::string>>>
-build_stack_map(const std::string& filename) {
-  std::ifstream folded_file{filename};
-  if (not folded_file.is_open()) {
-    std::cerr << "Could not open file: " << filename << " for reading\n";
-    std::exit(1);
+void write_profile_stacks_to_file(
+    const FoldedProfile& profile, const std::vector<uint32_t>& stack_ids,
+    const size_t stack_limit, const std::string& out_filename,
+    const size_t ratio_metric = 0,
+    const OutputOrder order = OutputOrder::input) {
+  FoldedLineWriter writer(profile, out_filename, order);
+  for (const auto stack_id : stack_ids) {
+    const uint32_t* begin = profile.stack_begin(stack_id);
+    const uint32_t* const end = profile.stack_end(stack_id);
+    if (stack_limit != 0 and static_cast<size_t>(end - begin) > stack_limit) {
+      begin = end - stack_limit;
+    }
+    const double sample_count = profile.sample_counts[stack_id];
+    if (ratio_metric == 0) {
+      writer.add(begin, end, sample_count);
+    } else if (sample_count != 0) {
+      writer.add(begin, end,
+                 profile.metric_values(ratio_metric)[stack_id] / sample_count);
+    }
   }
-  std::string line;
-  std::map<std::string, std::tuple<size_t, std::vector<std::string>>>
-      stack_map{};
-  while (std::getline(folded_file, line)) {
-    const std::string lowest_stack = get_lowest_stack(line);
-    if (stack_map.find(lowest_stack) != stack_map.end()) {
-      auto& current_stack = stack_map[lowest_stack];
-      std::get<0>(current_stack) += get_sample_count(line);
-      std::get<1>(current_stack).push_back(line);
-    } else {
-      stack_map[lowest_stack] = std::tuple<size_t, std::vector<std::string>>{
-          get_sample_count(line), std::vector<std::string>{line}};
+  writer.close();
+}
+
+/*!
+ * \brief Writes the selected stacks with a shown lowest frame, merged to the
+ * stack limit if it is non-zero
+ */
+void write_profile_view(const IndexedProfile& indexed_profile,
+                        const std::vector<uint32_t>& stack_ids,
+                        const std::vector<char>& frame_is_shown,
+                        const size_t stack_limit,
+                        const std::string& out_filename) {
+  const auto& profile = indexed_profile.profile;
+  const size_t ratio_metric = indexed_profile.ratio_metric;
+  const OutputOrder order = indexed_profile.output_order;
+  if (stack_limit == 0) {
+    write_profile_stacks_to_file(
+        profile, filter_profile(profile, stack_ids, frame_is_shown), 0,
+        out_filename, ratio_metric, order);
+  } else if (ratio_metric != 0) {
+    // The trees of both metrics must have the same nodes
+    const auto numerator_tree =
+        build_leaf_tree(profile, stack_ids, stack_limit, ratio_metric);
+    write_leaf_tree_to_file(profile,
+                            build_leaf_tree(profile, stack_ids, stack_limit),
+                            frame_is_shown, stack_limit, out_filename,
+                            &numerator_tree, order);
+  } else if (stack_ids.size() == profile.number_of_stacks()) {
+    // The precomputed tree contains exactly the selected stacks
+    write_leaf_tree_to_file(profile, indexed_profile.leaf_tree, frame_is_shown,
+                            stack_limit, out_filename, nullptr, order);
+  } else {
+    write_leaf_tree_to_file(profile,
+                            build_leaf_tree(profile, stack_ids, stack_limit),
+                            frame_is_shown, stack_limit, out_filename,
+                            nullptr, order);
+  }
+}
+
+/*!
+ * \brief Returns `prefix.name` with the characters of `name` that do not
+ * belong in a file name replaced by `_`
+ */
+std::string group_output_filename(const std::string& prefix,
+                                  const std::string& name) {
+  std::string filename = prefix + '.';
+  for (const char c : name) {
+    const bool allowed = (c >= 'a' and c <= 'z') or (c >= 'A' and c <= 'Z') or
+                         (c >= '0' and c <= '9') or c == '.' or c == '-' or
+                         c == '+' or c == '_';
+    filename += allowed ? c : '_';
+  }
+  return filename;
+}
+
+/*!
+ * \brief Returns the output file of each group as `group_output_filename`
+ * does, appending `.2`, `.3`, ... to the names that would otherwise be taken
+ * by an earlier group, e.g. for the groups `app-1/2` and `app-1_2`
+ */
+std::vector<std::string> unique_group_output_filenames(
+    const std::string& prefix, const std::vector<std::string>& names) {
+  std::vector<std::string> filenames{};
+  std::set<std::string> used_filenames{};
+  for (const auto& name : names) {
+    const std::string filename = group_output_filename(prefix, name);
+    std::string unique_filename = filename;
+    for (size_t suffix = 2; not used_filenames.insert(unique_filename).second;
+         ++suffix) {
+      unique_filename = filename + '.' + std::to_string(suffix);
     }
+    filenames.push_back(unique_filename);
   }
-  folded_file.close();
-  return stack_map;
+  return filenames;
 }
 
 /*!
- * \brief From the full map returns only the stack traces that have a percentage
- * of the total samples greater than the cutoff percentage and are in the list
- * of functions to show (also set by user input). If the list of functions to
- * show is empty then all functions that have a sample percentage about the
- * cutoff percentage are show.
+ * \brief Creates or truncates each file, throwing if one cannot be opened for
+ * writing, so that the groups written in parallel only start once every
+ * output file is known to be writable
  */
-std::vector<std::tuple<size_t, std::vector<std::string>>> filter_stack(
-    std::map<std::string, std::tuple<size_t, std::vector<std::string>>>
-        stack_map,
-    const double cutoff_percentage,
-    const std::vector<std::string>& regexes_to_show) {
-  const size_t total_samples = std::accumulate(
-      stack_map.begin(), stack_map.end(), size_t{0},
-      [](const size_t state,
-         const std::pair<const std::string,
-                         std::tuple<size_t, std::vector<std::string>>>&
-             element) { return state + std::get<0>(element.second); });
-  using IteratorType = typename std::decay<decltype(stack_map)>::type::iterator;
-  std::vector<std::tuple<size_t, std::vector<std::string>>> filtered_stacks{};
-  std::for_each(
-      std::move_iterator<IteratorType>(stack_map.begin()),
-      std::move_iterator<IteratorType>(stack_map.end()),
-      [&filtered_stacks, &total_samples, &cutoff_percentage, &regexes_to_show](
-          typename std::decay<decltype(stack_map)>::type::value_type&& t) {
-        if (static_cast<double>(std::get<0>(t.second)) /
-                static_cast<double>(total_samples) >
-            0.01 * cutoff_percentage) {
-          if (regexes_to_show.empty()) {
-            filtered_stacks.push_back(std::move(t.second));
-          } else {
-            const auto stack_frame = get_lowest_stack(std::get<1>(t.second)[0]);
-            for (const auto& regex_string : regexes_to_show) {
-              std::regex expression(regex_string);
-              if (std::regex_match(stack_frame.begin(), stack_frame.end(),
-                                   expression)) {
-                filtered_stacks.push_back(std::move(t.second));
-                break;
-              }
-            }
-          }
+void create_output_files(const std::vector<std::string>& filenames) {
+  for (const auto& filename : filenames) {
+    std::ofstream out_file(filename);
+    if (not out_file.is_open()) {
+      throw std::runtime_error("Could not open file: " + filename +
+                               " for writing");
+    }
+  }
+}
+
+/*!
+ * \brief Writes the stacks of each root frame to its own file
+ * `out_prefix.ROOT`, e.g. one per process or thread of a `perf` profile.
+ *
+ * The groups are filtered and written in parallel on `number_of_threads`
+ * threads from the one loaded profile, once all their files have been
+ * created. Roots whose names map to the same file name get a numbered suffix
+ * as described in `unique_group_output_filenames`. `frame_is_shown` holds the
+ * lowest frames matching the `--show` regular expressions, and the cutoff of
+ * each group is a percentage of the samples of that group, as if its stacks
+ * had been filtered on their own.
+ */
+void write_split_by_root_frame(const IndexedProfile& indexed_profile,
+                               const std::vector<uint32_t>& stack_ids,
+                               const std::vector<char>& frame_is_shown,
+                               const double cutoff_percentage,
+                               const size_t stack_limit,
+                               const std::string& out_prefix,
+                               const size_t number_of_threads) {
+  const auto& profile = indexed_profile.profile;
+  std::vector<std::vector<uint32_t>> stacks_by_root(profile.frames.size());
+  for (const auto stack_id : stack_ids) {
+    stacks_by_root[*profile.stack_begin(stack_id)].push_back(stack_id);
+  }
+  std::vector<uint32_t> roots{};
+  for (size_t frame_id = 0; frame_id < profile.frames.size(); ++frame_id) {
+    if (not stacks_by_root[frame_id].empty()) {
+      roots.push_back(static_cast<uint32_t>(frame_id));
+    }
+  }
+  std::vector<std::string> root_names{};
+  for (const auto root : roots) {
+    root_names.push_back(profile.frames[root].str());
+  }
+  const auto out_filenames =
+      unique_group_output_filenames(out_prefix, root_names);
+  create_output_files(out_filenames);
+  run_in_parallel(roots.size(), number_of_threads, [&](const size_t i) {
+    const auto& group_stack_ids = stacks_by_root[roots[i]];
+    double group_samples = 0.0;
+    for (const auto stack_id : group_stack_ids) {
+      group_samples += profile.sample_counts[stack_id];
+    }
+    std::vector<char> group_frame_is_shown = frame_is_shown;
+    apply_cutoff(profile, group_stack_ids, cutoff_percentage, group_samples,
+                 group_frame_is_shown);
+    write_profile_view(indexed_profile, group_stack_ids, group_frame_is_shown,
+                       stack_limit, out_filenames[i]);
+  });
+}
+
+/*!
+ * \brief Writes the stacks whose lowest frame matches each `--show` regular
+ * expression to its own file `out_prefix.REGEX`, so that one run gives the
+ * view of every hot function.
+ *
+ * `matches_by_regex` holds the lowest frames matching each regular
+ * expression, computed beforehand since the frame matcher is not thread-safe.
+ * The files are created up front and written in parallel on
+ * `number_of_threads` threads, and each one is the output of filtering with
+ * only its `--show` regular expression. Regular expressions that map to the
+ * same file name, e.g. `(foo)` and `[foo]`, get a numbered suffix as described
+ * in `unique_group_output_filenames`.
+ */
+void write_split_by_show_regex(
+    const IndexedProfile& indexed_profile,
+    const std::vector<uint32_t>& stack_ids,
+    const std::vector<std::string>& regexes_to_show,
+    const std::vector<std::vector<char>>& matches_by_regex,
+    const double cutoff_percentage, const size_t stack_limit,
+    const std::string& out_prefix, const size_t number_of_threads) {
+  const auto& profile = indexed_profile.profile;
+  const double total_samples = std::accumulate(
+      profile.sample_counts.begin(), profile.sample_counts.end(), 0.0);
+  const auto out_filenames =
+      unique_group_output_filenames(out_prefix, regexes_to_show);
+  create_output_files(out_filenames);
+  run_in_parallel(regexes_to_show.size(), number_of_threads,
+                  [&](const size_t i) {
+                    std::vector<char> frame_is_shown = matches_by_regex[i];
+                    apply_cutoff(profile, stack_ids, cutoff_percentage,
+                                 total_samples, frame_is_shown);
+                    write_profile_view(indexed_profile, stack_ids,
+                                       frame_is_shown, stack_limit,
+                                       out_filenames[i]);
+                  });
+}
+
+/*!
+ * \brief Prints the memory used by the frame dictionary, stacks, counts, and
+ * derived indexes of the profile, as `print_memory_report` does for the map of
+ * lines
+ */
+void print_profile_memory_report(std::ostream& os,
+                                 const IndexedProfile& indexed_profile,
+                                 const size_t input_bytes) {
+  const auto& profile = indexed_profile.profile;
+  size_t frame_bytes =
+      profile.frames.name_offsets.capacity() * sizeof(uint64_t) +
+      profile.frames.characters.capacity();
+  // Hash tables store one node per entry plus a bucket array
+  const size_t dictionary_bytes =
+      profile.frame_ids.size() *
+          (sizeof(std::string) + sizeof(uint32_t) + 2 * sizeof(void*)) +
+      profile.frame_ids.bucket_count() * sizeof(void*);
+  for (const auto& frame_and_id : profile.frame_ids) {
+    frame_bytes += heap_bytes(frame_and_id.first);
+  }
+  const size_t stack_bytes =
+      profile.stack_offsets.capacity() * sizeof(uint64_t) +
+      profile.stack_frames.capacity() * sizeof(uint32_t);
+  size_t count_bytes = profile.sample_counts.capacity() * sizeof(double);
+  for (const auto& values : profile.other_metric_values) {
+    count_bytes += values.capacity() * sizeof(double);
+  }
+  const size_t lookup_bytes =
+      profile.stack_lookup.size() * (sizeof(uint64_t) + 3 * sizeof(void*)) +
+      profile.stack_lookup.bucket_count() * sizeof(void*);
+  const auto& frame_index = indexed_profile.frame_index;
+  const size_t frame_index_bytes =
+      frame_index.posting_offsets.capacity() * sizeof(uint64_t) +
+      frame_index.postings.capacity();
+  const auto& tree = indexed_profile.leaf_tree;
+  const size_t tree_bytes = tree.number_of_nodes() *
+                            (4 * sizeof(uint32_t) + 2 * sizeof(double));
+
+  const auto print_row = [&os, &input_bytes](const char* const category,
+                                             const size_t count,
+                                             const size_t bytes) {
+    char buffer[128];
+    std::snprintf(buffer, sizeof(buffer), "%-14s %12zu %16zu %12.3f\n",
+                  category, count, bytes,
+                  input_bytes == 0 ? 0.0
+                                   : static_cast<double>(bytes) /
+                                         static_cast<double>(input_bytes));
+    os << buffer;
+  };
+  char buffer[128];
+  std::snprintf(buffer, sizeof(buffer), "%-14s %12s %16s %12s\n", "category",
+                "count", "bytes", "x input");
+  os << buffer;
+  print_row("frame strings", profile.frames.size(), frame_bytes);
+  print_row("frame lookup", profile.frame_ids.size(), dictionary_bytes);
+  print_row("stack frames", profile.stack_frames.size(), stack_bytes);
+  print_row("sample counts", profile.sample_counts.size(), count_bytes);
+  print_row("stack lookup", profile.stack_lookup.size(), lookup_bytes);
+  print_row("frame index", frame_index.postings.size(), frame_index_bytes);
+  print_row("leaf tree", tree.number_of_nodes(), tree_bytes);
+  print_row("total", profile.number_of_stacks(),
+            frame_bytes + dictionary_bytes + stack_bytes + count_bytes +
+                lookup_bytes + frame_index_bytes + tree_bytes);
+  std::snprintf(buffer, sizeof(buffer), "%-14s %12s %16zu\n", "input file",
+                "", input_bytes);
+  os << buffer;
+}
+
+/*!
+ * \brief A built-in category of frames. A frame belongs to the category if its
+ * name equals one of the patterns, where a pattern `prefix*` matches any name
+ * starting with `prefix` and `*part*` any name containing `part`.
+ */
+struct CategoryPreset {
+  std::string name;
+  std::vector<std::string> patterns;
+};
+
+/*!
+ * \brief The built-in categories, in the order frames are checked against them
+ */
+const std::vector<CategoryPreset>& category_presets() {
+  static const std::vector<CategoryPreset> presets{
+      {"allocation",
+       {"malloc", "calloc", "realloc", "free", "cfree", "memalign",
+        "posix_memalign", "aligned_alloc", "valloc", "__libc_malloc",
+        "__libc_calloc", "__libc_realloc", "__libc_free", "__GI___libc_malloc",
+        "__GI___libc_free", "_int_malloc", "_int_free", "_int_realloc",
+        "malloc_consolidate", "sysmalloc", "operator new*",
+        "operator delete*", "je_*", "tc_*", "tcmalloc::*", "mi_malloc*",
+        "mi_free*"}},
+      {"locking",
+       {"pthread_mutex_*", "__pthread_mutex_*", "pthread_rwlock_*",
+        "pthread_spin_*", "pthread_cond_*", "__pthread_cond_*",
+        "__lll_lock_wait*", "__lll_unlock_wake*", "*futex*", "sem_wait",
+        "sem_timedwait", "sem_post", "std::mutex::*", "std::unique_lock*",
+        "std::condition_variable::*", "*spin_lock*", "omp_set_lock",
+        "omp_unset_lock", "__kmp_acquire_*lock*"}},
+      {"mpi",
+       {"MPI_*", "PMPI_*", "mpi_*", "pmpi_*", "ompi_*", "MPID*", "MPIR_*",
+        "MPIC_*", "mca_*", "opal_*", "ucp_*", "uct_*", "psm2_*", "fi_*"}},
+      {"io",
+       {"read", "write", "readv", "writev", "pread", "pread64", "pwrite",
+        "pwrite64", "open", "open64", "openat", "close", "fsync", "fdatasync",
+        "lseek", "lseek64", "__libc_read", "__libc_write", "__libc_open64",
+        "__GI___libc_read", "__GI___libc_write", "__GI___libc_open",
+        "__GI___close", "fread", "fwrite", "fopen", "fopen64", "fclose",
+        "fflush", "_IO_*", "vfs_*", "ksys_read", "ksys_write", "ext4_*",
+        "xfs_*", "nfs_*", "H5*", "aio_*", "io_uring_*"}},
+      {"syscalls",
+       {"syscall", "__syscall*", "sys_*", "__x64_sys_*", "__ia32_sys_*",
+        "__arm64_sys_*", "entry_SYSCALL*", "do_syscall_64", "syscall_exit*",
+        "__sys_*"}}};
+  return presets;
+}
+
+/*!
+ * \brief Returns whether `name` matches a pattern of a `CategoryPreset`
+ */
+bool matches_category_pattern(const std::string& name,
+                              const std::string& pattern) {
+  if (pattern.size() > 1 and pattern.front() == '*' and
+      pattern.back() == '*') {
+    return name.find(pattern.data() + 1, 0, pattern.size() - 2) !=
+           std::string::npos;
+  }
+  if (not pattern.empty() and pattern.back() == '*') {
+    return name.compare(0, pattern.size() - 1, pattern, 0,
+                        pattern.size() - 1) == 0;
+  }
+  return name == pattern;
+}
+
+/*!
+ * \brief The samples of the selected stacks broken down by category
+ */
+struct CategoryBreakdown {
+  /// The category names, the last one being `other`
+  std::vector<std::string> names;
+  /// The samples of the stacks whose lowest frame that has a category is in
+  /// the category, which sum to the samples of all selected stacks
+  std::vector<double> self_samples;
+  /// The samples of the stacks with a frame in the category at any depth
+  std::vector<double> inclusive_samples;
+  /// The samples of all stacks in the profile
+  double total_samples;
+};
+
+/*!
+ * \brief Classifies every distinct frame once, into the first of the user
+ * categories, `NAME=REGEX`, or else the built-in categories it matches, and
+ * sums the samples of the stacks in `stack_ids` by category
+ */
+CategoryBreakdown category_breakdown(
+    const FoldedProfile& profile, FrameMatcher& frame_matcher,
+    const std::vector<uint32_t>& stack_ids,
+    const std::vector<std::string>& user_categories) {
+  CategoryBreakdown breakdown{};
+  const auto unclassified = std::numeric_limits<uint32_t>::max();
+  std::vector<uint32_t> frame_categories(profile.frames.size(), unclassified);
+  for (const auto& user_category : user_categories) {
+    const auto separator = user_category.find('=');
+    if (separator == std::string::npos) {
+      throw std::invalid_argument("Category '" + user_category +
+                                  "' is not of the form NAME=REGEX");
+    }
+    const auto category = static_cast<uint32_t>(breakdown.names.size());
+    breakdown.names.push_back(user_category.substr(0, separator));
+    const auto& frame_matches =
+        frame_matcher.matches(user_category.substr(separator + 1));
+    for (size_t frame_id = 0; frame_id < profile.frames.size(); ++frame_id) {
+      if (frame_categories[frame_id] == unclassified and
+          frame_matches[frame_id]) {
+        frame_categories[frame_id] = category;
+      }
+    }
+  }
+  // The presets match the names without their _[k], _[j], or _[i] annotation
+  std::vector<std::string> unannotated_frames{};
+  unannotated_frames.reserve(profile.frames.size());
+  for (size_t frame_id = 0; frame_id < profile.frames.size(); ++frame_id) {
+    unannotated_frames.push_back(profile.frames[frame_id].str());
+  }
+  for (auto& frame : unannotated_frames) {
+    if (frame_kind::of(frame) != frame_kind::user) {
+      frame.resize(frame.size() - 4);
+    }
+  }
+  for (const auto& preset : category_presets()) {
+    const auto category = static_cast<uint32_t>(breakdown.names.size());
+    breakdown.names.push_back(preset.name);
+    for (size_t frame_id = 0; frame_id < profile.frames.size(); ++frame_id) {
+      if (frame_categories[frame_id] != unclassified) {
+        continue;
+      }
+      for (const auto& pattern : preset.patterns) {
+        if (matches_category_pattern(unannotated_frames[frame_id], pattern)) {
+          frame_categories[frame_id] = category;
+          break;
+        }
+      }
+    }
+  }
+  const auto other = static_cast<uint32_t>(breakdown.names.size());
+  breakdown.names.push_back("other");
+
+  breakdown.self_samples.assign(breakdown.names.size(), 0.0);
+  breakdown.inclusive_samples.assign(breakdown.names.size(), 0.0);
+  breakdown.total_samples = std::accumulate(
+      profile.sample_counts.begin(), profile.sample_counts.end(), 0.0);
+  // The last stack each category was counted for, so that it is only counted
+  // once per stack
+  std::vector<size_t> counted_for_stack(breakdown.names.size(),
+                                        std::numeric_limits<size_t>::max());
+  for (const auto stack_id : stack_ids) {
+    const double sample_count = profile.sample_counts[stack_id];
+    uint32_t self_category = other;
+    for (const uint32_t* frame = profile.stack_end(stack_id);
+         frame != profile.stack_begin(stack_id);) {
+      const uint32_t category = frame_categories[*--frame];
+      if (category == unclassified) {
+        continue;
+      }
+      if (self_category == other) {
+        self_category = category;
+      }
+      if (counted_for_stack[category] != stack_id) {
+        counted_for_stack[category] = stack_id;
+        breakdown.inclusive_samples[category] += sample_count;
+      }
+    }
+    breakdown.self_samples[self_category] += sample_count;
+    if (self_category == other) {
+      breakdown.inclusive_samples[other] += sample_count;
+    }
+  }
+  return breakdown;
+}
+
+/*!
+ * \brief Prints the self and inclusive samples of each category and their
+ * percentage of all samples
+ */
+void print_category_breakdown(std::ostream& os,
+                              const CategoryBreakdown& breakdown) {
+  const auto percentage = [&breakdown](const double samples) {
+    return breakdown.total_samples == 0
+               ? 0.0
+               : 100.0 * samples / breakdown.total_samples;
+  };
+  char buffer[160];
+  std::snprintf(buffer, sizeof(buffer), "%-14s %8s %16s %11s %16s\n",
+                "category", "self", "self samples", "inclusive",
+                "incl. samples");
+  os << buffer;
+  for (size_t category = 0; category < breakdown.names.size(); ++category) {
+    std::snprintf(buffer, sizeof(buffer), "%-14s %7.2f%% %16s %10.2f%% %16s\n",
+                  breakdown.names[category].c_str(),
+                  percentage(breakdown.self_samples[category]),
+                  format_weight(breakdown.self_samples[category]).c_str(),
+                  percentage(breakdown.inclusive_samples[category]),
+                  format_weight(breakdown.inclusive_samples[category]).c_str());
+    os << buffer;
+  }
+}
+
+/*!
+ * \brief Returns `str` escaped for use inside a JSON string
+ */
+std::string json_escape(const std::string& str) {
+  std::string escaped{};
+  escaped.reserve(str.size());
+  for (const char c : str) {
+    switch (c) {
+      case '"':
+        escaped += "\\\"";
+        break;
+      case '\\':
+        escaped += "\\\\";
+        break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          char buffer[8];
+          std::snprintf(buffer, sizeof(buffer), "\\u%04x",
+                        static_cast<unsigned int>(c));
+          escaped += buffer;
+        } else {
+          escaped += c;
         }
+    }
+  }
+  return escaped;
+}
+
+/*!
+ * \brief Returns the JSON description of the part of the tree below `root`
+ * that is visible when `root` is drawn `width_in_pixels` wide.
+ *
+ * Nodes narrower than `min_pixels` and their callers are pruned, as are nodes
+ * more than `max_depth` levels below `root`, so the response size depends on
+ * the zoom level rather than on the size of the profile. Each node is sent as
+ * `[id, depth, x, width, name]` with `x` and `width` as fractions of `root`.
+ */
+std::string leaf_tree_json(const FoldedProfile& profile, const LeafTree& tree,
+                           const std::vector<char>& frame_is_shown,
+                           const uint32_t root, const double width_in_pixels,
+                           const double min_pixels, const size_t max_depth) {
+  // The root of the tree only contains the shown lowest frames
+  const auto shown_samples = [&tree, &frame_is_shown](const uint32_t node) {
+    return tree.parents[node] == 0 and not frame_is_shown[tree.frames[node]]
+               ? 0.0
+               : tree.inclusive_counts[node];
+  };
+  double root_samples = 0;
+  if (root == 0) {
+    for (uint32_t child = tree.first_children[0]; child != LeafTree::no_node;
+         child = tree.next_siblings[child]) {
+      root_samples += shown_samples(child);
+    }
+  } else {
+    root_samples = tree.inclusive_counts[root];
+  }
+
+  std::ostringstream json{};
+  json << "{\"root\": " << root
+       << ", \"samples\": " << format_weight(root_samples)
+       << ", \"path\": [";
+  // The frames from the lowest frame up to `root`, for zooming back out
+  std::vector<uint32_t> ancestors{};
+  for (uint32_t node = root; node != 0; node = tree.parents[node]) {
+    ancestors.push_back(node);
+  }
+  for (auto node = ancestors.rbegin(); node != ancestors.rend(); ++node) {
+    json << (node == ancestors.rbegin() ? "" : ", ") << "[" << *node
+         << ", \"" << json_escape(profile.frames[tree.frames[*node]])
+         << "\"]";
+  }
+  json << "], \"nodes\": [";
+  if (root_samples == 0) {
+    json << "]}";
+    return json.str();
+  }
+
+  struct Visit {
+    uint32_t node;
+    size_t depth;
+    double x;
+  };
+  std::vector<Visit> to_visit{{root, 0, 0.0}};
+  bool first = true;
+  while (not to_visit.empty()) {
+    const Visit visit = to_visit.back();
+    to_visit.pop_back();
+    if (visit.depth >= max_depth) {
+      continue;
+    }
+    double x = visit.x;
+    for (uint32_t child = tree.first_children[visit.node];
+         child != LeafTree::no_node; child = tree.next_siblings[child]) {
+      const double width = shown_samples(child) / root_samples;
+      if (width * width_in_pixels >= min_pixels and width > 0.0) {
+        json << (first ? "" : ", ") << "[" << child << ", " << visit.depth
+             << ", " << x << ", " << width << ", \""
+             << json_escape(profile.frames[tree.frames[child]]) << "\"]";
+        first = false;
+        to_visit.push_back(Visit{child, visit.depth + 1, x});
+      }
+      x += width;
+    }
+  }
+  json << "]}";
+  return json.str();
+}
+
+/*!
+ * \brief The page served by `serve_leaf_tree`. It requests the visible part of
+ * the tree for the current zoom level and draws it as an inverted flamegraph.
+ */
+const char* const viewer_html = R"html(<!DOCTYPE html>
+<html><head><meta charset="utf-8"><title>FlameGraphFilter</title>
+<style>
+body { font: 12px sans-serif; margin: 0; }
+#path { padding: 4px; height: 16px; }
+#path a { cursor: pointer; color: #06c; margin-right: 6px; }
+#graph { position: relative; }
+.frame { position: absolute; height: 15px; overflow: hidden;
+         white-space: nowrap; border: 1px solid #fff; box-sizing: border-box;
+         cursor: pointer; padding-left: 2px; }
+</style></head>
+<body><div id="path"></div><div id="graph"></div>
+<script>
+function color(name) {
+  var hash = 0;
+  for (var i = 0; i < name.length; ++i) {
+    hash = (hash * 31 + name.charCodeAt(i)) | 0;
+  }
+  return 'hsl(' + (Math.abs(hash) % 60) + ', 80%, 60%)';
+}
+function zoom(node) {
+  var width = document.body.clientWidth;
+  fetch('/tree?node=' + node + '&width=' + width + '&min=1&depth=200')
+      .then(function(response) { return response.json(); })
+      .then(function(tree) {
+        var path = document.getElementById('path');
+        path.innerHTML = '';
+        var links = [[0, 'all (' + tree.samples + ' samples)']]
+            .concat(tree.path);
+        links.forEach(function(link) {
+          var a = document.createElement('a');
+          a.textContent = link[1];
+          a.onclick = function() { zoom(link[0]); };
+          path.appendChild(a);
+        });
+        var graph = document.getElementById('graph');
+        graph.innerHTML = '';
+        tree.nodes.forEach(function(node) {
+          var div = document.createElement('div');
+          div.className = 'frame';
+          div.style.left = (node[2] * width) + 'px';
+          div.style.width = (node[3] * width) + 'px';
+          div.style.top = (node[1] * 16) + 'px';
+          div.style.background = color(node[4]);
+          div.textContent = node[4];
+          div.title = node[4] + ' (' + (100 * node[3]).toFixed(2) + '%)';
+          div.onclick = function() { zoom(node[0]); };
+          graph.appendChild(div);
+        });
       });
-  return filtered_stacks;
 }
+zoom(0);
+</script></body></html>
+)html";
 
-//
 /*!
- * \brief Removes the top of the stack. That is, for main()->foo()->bar()->baz()
- * with a limit of two main() and foo() would be removed. the bottom of the
- * stack. For
+ * \brief Parses the query string of a request target, e.g. `/tree?node=3`,
+ * into its path and parameters
  */
-std::vector<std::tuple<size_t, std::vector<std::string>>> shrink_to_stack_limit(
-    std::vector<std::tuple<size_t, std::vector<std::string>>> stacks_map,
-    const size_t stack_limit) {
-  if (stack_limit == 0) {
-    return stacks_map;
+std::string parse_request_target(const std::string& target,
+                                 std::map<std::string, std::string>& query) {
+  const auto question_mark = target.find('?');
+  if (question_mark == std::string::npos) {
+    return target;
+  }
+  std::istringstream parameters(target.substr(question_mark + 1));
+  std::string parameter{};
+  while (std::getline(parameters, parameter, '&')) {
+    const auto equals = parameter.find('=');
+    if (equals != std::string::npos) {
+      query[parameter.substr(0, equals)] = parameter.substr(equals + 1);
+    }
+  }
+  return target.substr(0, question_mark);
+}
+
+/*!
+ * \brief Writes all of `data` to the socket
+ */
+void send_all(const int socket, const std::string& data) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    const ssize_t result =
+        ::send(socket, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (result <= 0) {
+      return;
+    }
+    sent += static_cast<size_t>(result);
+  }
+}
+
+/*!
+ * \brief Serves an interactive inverted flamegraph of the tree on
+ * `http://127.0.0.1:port/` until the process is interrupted.
+ *
+ * The browser only receives the nodes that are at least a pixel wide at the
+ * current zoom level, so giant profiles stay responsive without a global
+ * cutoff. The server only listens on the loopback interface.
+ */
+void serve_leaf_tree(const FoldedProfile& profile, const LeafTree& tree,
+                     const std::vector<char>& frame_is_shown,
+                     const uint16_t port) {
+  const int server = ::socket(AF_INET, SOCK_STREAM, 0);
+  if (server < 0) {
+    std::cerr << "Could not create a socket\n";
+    std::exit(1);
+  }
+  const int reuse_address = 1;
+  ::setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &reuse_address,
+               sizeof(reuse_address));
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port);
+  if (::bind(server, reinterpret_cast<const sockaddr*>(&address),
+             sizeof(address)) != 0 or
+      ::listen(server, 16) != 0) {
+    std::cerr << "Could not listen on 127.0.0.1:" << port << "\n";
+    std::exit(1);
   }
-  for (auto& stack_list : stacks_map) {
-    for (auto& stack : std::get<1>(stack_list)) {
-      // We remove the unwanted stacks by recursive calls to find
-      typename std::string::size_type current_position = stack.size();
-      for (size_t i = 0;
-           i < stack_limit and current_position != std::string::npos; ++i) {
-        current_position = stack.rfind(';', current_position - 1);
+  std::cerr << "Serving the flamegraph on http://127.0.0.1:" << port << "/\n";
+
+  std::vector<char> buffer(8192);
+  while (true) {
+    const int client = ::accept(server, nullptr, nullptr);
+    if (client < 0) {
+      continue;
+    }
+    // Requests are served one at a time, so an idle connection, e.g. one a
+    // browser opens speculatively, must not block the others for long
+    timeval timeout{};
+    timeout.tv_sec = 2;
+    ::setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    ::setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    std::string request{};
+    while (request.find("\r\n\r\n") == std::string::npos and
+           request.size() < buffer.size()) {
+      const ssize_t received = ::recv(client, buffer.data(), buffer.size(), 0);
+      if (received <= 0) {
+        break;
       }
-      if (current_position != std::string::npos) {
-        stack = stack.substr(current_position + 1, std::string::npos);
+      request.append(buffer.data(), static_cast<size_t>(received));
+    }
+    std::istringstream request_line(request.substr(0, request.find("\r\n")));
+    std::string method{};
+    std::string target{};
+    request_line >> method >> target;
+    std::map<std::string, std::string> query{};
+    const std::string path = parse_request_target(target, query);
+
+    std::string status = "200 OK";
+    std::string content_type = "text/html; charset=utf-8";
+    std::string body{};
+    if (method != "GET") {
+      status = "405 Method Not Allowed";
+    } else if (path == "/") {
+      body = viewer_html;
+    } else if (path == "/tree") {
+      // Parameters that are not non-negative numbers are NaN
+      const auto parameter = [&query](const std::string& name,
+                                      const double default_value) {
+        if (not query.count(name)) {
+          return default_value;
+        }
+        const char* const begin = query[name].c_str();
+        char* end = nullptr;
+        const double value = std::strtod(begin, &end);
+        return end != begin and *end == '\0' and value >= 0.0 and
+                       value < 4.0e9
+                   ? value
+                   : std::numeric_limits<double>::quiet_NaN();
+      };
+      const double node = parameter("node", 0.0);
+      const double width = parameter("width", 1200.0);
+      const double min_pixels = parameter("min", 1.0);
+      const double depth = parameter("depth", 200.0);
+      if (std::isnan(node) or std::isnan(width) or std::isnan(min_pixels) or
+          std::isnan(depth)) {
+        status = "400 Bad Request";
+      } else if (static_cast<size_t>(node) >= tree.number_of_nodes()) {
+        status = "404 Not Found";
+      } else {
+        content_type = "application/json";
+        body = leaf_tree_json(profile, tree, frame_is_shown,
+                              static_cast<uint32_t>(node), width, min_pixels,
+                              static_cast<size_t>(depth));
       }
+    } else {
+      status = "404 Not Found";
     }
+    send_all(client, "HTTP/1.1 " + status +
+                         "\r\nContent-Type: " + content_type +
+                         "\r\nContent-Length: " + std::to_string(body.size()) +
+                         "\r\nConnection: close\r\n\r\n" + body);
+    ::close(client);
   }
-  return stacks_map;
 }
 
 /*!
- * \brief Write the stack list return by `shrink_to_stack_limit` to disk
+ * \brief Returns the lowest frames that are shown, sorted by their samples
+ * over the selected stacks in descending order
  */
-void write_filtered_stack_to_file(
-    const std::vector<std::tuple<size_t, std::vector<std::string>>>& stacks,
-    const std::string& out_filename) {
-  std::ofstream out_file(out_filename);
-  if (not out_file.is_open()) {
-    std::cerr << "Could not open file: " << out_filename << " for writing\n";
-    std::exit(1);
+std::vector<std::pair<double, uint32_t>> top_lowest_frames(
+    const FoldedProfile& profile, const std::vector<uint32_t>& stack_ids,
+    const std::vector<char>& frame_is_shown) {
+  std::vector<double> lowest_frame_samples(profile.frames.size(), 0.0);
+  for (const auto stack_id : stack_ids) {
+    lowest_frame_samples[profile.lowest_frame(stack_id)] +=
+        profile.sample_counts[stack_id];
   }
-  for (const auto& stack_list : stacks) {
-    for (const auto& stack : std::get<1>(stack_list)) {
-      out_file << stack << '\n';
+  std::vector<std::pair<double, uint32_t>> top{};
+  for (size_t frame_id = 0; frame_id < profile.frames.size(); ++frame_id) {
+    if (frame_is_shown[frame_id]) {
+      top.emplace_back(lowest_frame_samples[frame_id],
+                       static_cast<uint32_t>(frame_id));
+    }
+  }
+  std::sort(top.begin(), top.end(),
+            [](const std::pair<double, uint32_t>& a,
+               const std::pair<double, uint32_t>& b) {
+              return a.first > b.first or
+                     (a.first == b.first and a.second < b.second);
+            });
+  return top;
+}
+
+/*!
+ * \brief Reads filter commands from `is` and applies them to the profile,
+ * which is only loaded once.
+ *
+ * The stacks selected by `focus` and `hide` and the lowest frames shown are
+ * only recomputed when the options they depend on change, and the regular
+ * expressions are only matched once per distinct frame for the whole session.
+ */
+void run_interactive(const IndexedProfile& indexed_profile,
+                     std::vector<std::string> regexes_to_show,
+                     std::vector<std::string> regexes_to_focus,
+                     std::vector<std::string> regexes_to_hide,
+                     std::vector<std::string> patterns_to_match,
+                     double cutoff_percentage, size_t stack_limit,
+                     std::istream& is, std::ostream& os) {
+  const auto& profile = indexed_profile.profile;
+  const double total_samples = std::accumulate(
+      profile.sample_counts.begin(), profile.sample_counts.end(), 0.0);
+  FrameMatcher frame_matcher(profile);
+  std::vector<uint32_t> stack_ids{};
+  std::vector<char> frame_is_shown{};
+  bool stacks_changed = true;
+  bool filter_changed = true;
+
+  const auto update = [&]() {
+    if (stacks_changed) {
+      stack_ids = select_stacks(profile, indexed_profile.frame_index,
+                                frame_matcher, regexes_to_focus,
+                                regexes_to_hide, patterns_to_match);
+    }
+    if (stacks_changed or filter_changed) {
+      frame_is_shown = shown_lowest_frames(profile, frame_matcher, stack_ids,
+                                           cutoff_percentage, regexes_to_show);
+    }
+    stacks_changed = false;
+    filter_changed = false;
+  };
+  const auto print_summary = [&]() {
+    update();
+    double shown_samples = 0;
+    size_t shown_stacks = 0;
+    for (const auto stack_id : stack_ids) {
+      if (frame_is_shown[profile.lowest_frame(stack_id)]) {
+        shown_samples += profile.sample_counts[stack_id];
+        ++shown_stacks;
+      }
+    }
+    char buffer[160];
+    std::snprintf(buffer, sizeof(buffer),
+                  "%zu stacks, %zu lowest frames, %.2f%% of samples shown "
+                  "(cutoff %g%%, stack limit %zu)\n",
+                  shown_stacks,
+                  static_cast<size_t>(std::count(frame_is_shown.begin(),
+                                                 frame_is_shown.end(), 1)),
+                  total_samples == 0
+                      ? 0.0
+                      : 100.0 * shown_samples / total_samples,
+                  cutoff_percentage, stack_limit);
+    os << buffer;
+  };
+  // Throws before the state is changed if a regular expression is invalid
+  const auto check_regexes = [](const std::vector<std::string>& regexes) {
+    for (const auto& regex_string : regexes) {
+      std::regex{regex_string};
+    }
+  };
+  // Unlike std::stod and std::stoul these reject trailing text and negative
+  // numbers, and name the command in the error
+  const auto parse_percentage = [](const std::string& command,
+                                   const std::string& text) {
+    char* end = nullptr;
+    const double value = std::strtod(text.c_str(), &end);
+    if (text.empty() or *end != '\0' or not std::isfinite(value) or
+        value < 0.0) {
+      throw std::invalid_argument(command +
+                                  " expects a non-negative PERCENT, e.g. " +
+                                  command + " 0.5, not '" + text + "'");
+    }
+    return value;
+  };
+  const auto parse_count = [](const std::string& command,
+                              const std::string& text,
+                              const std::string& name) {
+    char* end = nullptr;
+    errno = 0;
+    const unsigned long long value =
+        std::strtoull(text.c_str(), &end, 10);
+    if (text.empty() or text[0] < '0' or text[0] > '9' or *end != '\0' or
+        errno == ERANGE or value > std::numeric_limits<size_t>::max()) {
+      throw std::invalid_argument(command +
+                                  " expects a non-negative whole number " +
+                                  name + ", e.g. " + command + " 10, not '" +
+                                  text + "'");
+    }
+    return static_cast<size_t>(value);
+  };
+  const auto print_help = [&os]() {
+    os << "Commands:\n"
+          "  show [REGEX...]   show only these lowest frames (none: all)\n"
+          "  focus [REGEX...]  only stacks through these frames (none: all)\n"
+          "  hide [REGEX...]   drop stacks through these frames (none: none)\n"
+          "  match [PATH...]   only stacks matching these paths (none: all)\n"
+          "  cutoff PERCENT    set the cutoff percentage\n"
+          "  limit DEPTH       set the stack limit (0: whole stack)\n"
+          "  top [N]           list the N lowest frames with most samples\n"
+          "  write FILE        write the current view as a folded file\n"
+          "  help              print this message\n"
+          "  quit              leave the interactive mode\n";
+  };
+
+  print_summary();
+  std::string line{};
+  while (os << "> " << std::flush, std::getline(is, line)) {
+    std::istringstream words(line);
+    std::string command{};
+    if (not(words >> command)) {
+      continue;
+    }
+    std::vector<std::string> arguments{};
+    for (std::string argument{}; words >> argument;) {
+      arguments.push_back(argument);
+    }
+    try {
+      if (command == "quit" or command == "exit") {
+        break;
+      } else if (command == "help") {
+        print_help();
+      } else if (command == "show") {
+        check_regexes(arguments);
+        regexes_to_show = arguments;
+        filter_changed = true;
+        print_summary();
+      } else if (command == "focus") {
+        check_regexes(arguments);
+        regexes_to_focus = arguments;
+        stacks_changed = true;
+        print_summary();
+      } else if (command == "hide") {
+        check_regexes(arguments);
+        regexes_to_hide = arguments;
+        stacks_changed = true;
+        print_summary();
+      } else if (command == "match") {
+        stacks_matching_patterns(profile, frame_matcher, arguments);
+        patterns_to_match = arguments;
+        stacks_changed = true;
+        print_summary();
+      } else if (command == "cutoff" and arguments.size() == 1) {
+        cutoff_percentage = parse_percentage(command, arguments[0]);
+        filter_changed = true;
+        print_summary();
+      } else if (command == "limit" and arguments.size() == 1) {
+        stack_limit = parse_count(command, arguments[0], "DEPTH");
+        print_summary();
+      } else if (command == "top" and arguments.size() <= 1) {
+        const size_t number_to_print =
+            arguments.empty() ? 20 : parse_count(command, arguments[0], "N");
+        update();
+        const auto top = top_lowest_frames(profile, stack_ids, frame_is_shown);
+        for (size_t i = 0; i < std::min(number_to_print, top.size()); ++i) {
+          char buffer[64];
+          std::snprintf(buffer, sizeof(buffer), "%7.2f%% %14s  ",
+                        total_samples == 0
+                            ? 0.0
+                            : 100.0 * top[i].first / total_samples,
+                        format_weight(top[i].first).c_str());
+          os << buffer << profile.frames[top[i].second] << '\n';
+        }
+      } else if (command == "write" and arguments.size() == 1) {
+        update();
+        write_profile_view(indexed_profile, stack_ids, frame_is_shown,
+                           stack_limit, arguments[0]);
+        os << "Wrote " << arguments[0] << '\n';
+      } else {
+        os << "Unknown command or wrong arguments: " << line << '\n';
+        print_help();
+      }
+    } catch (std::exception& e) {
+      // Bad regular expressions or numbers should not end the session
+      os << "error: " << e.what() << '\n';
     }
   }
-  out_file.close();
 }
 
 int main(int argc, char* argv[]) {
@@ -191,9 +5257,156 @@ int main(int argc, char* argv[]) {
          "A list of regular expressions (run through the C++ STL regex "
          "library) to be shown. If none are specified then everything is "
          "shown.")  //
+        ("focus", po::value<std::vector<std::string>>()->composing(),
+         "A list of regular expressions. Only stacks that contain a frame "
+         "matching one of them at any depth are shown.")  //
+        ("hide", po::value<std::vector<std::string>>()->composing(),
+         "A list of regular expressions. Stacks that contain a frame matching "
+         "one of them at any depth are not shown.")  //
+        ("match", po::value<std::vector<std::string>>()->composing(),
+         "A list of stack path patterns. Only stacks matching one of them are "
+         "shown. A pattern lists the frames from the root to the lowest frame "
+         "separated by ';', where each frame is '...' for any number of "
+         "frames, '*' for one frame, or regular expressions joined by '&', "
+         "each negated by a leading '!'. E.g. "
+         "'...;solve;...;MPI_Allreduce;...' selects the stacks in which solve "
+         "calls MPI_Allreduce.")  //
+        ("metrics", po::value<std::string>(),
+         "Comma separated names of the value columns after each stack, e.g. "
+         "cycles,instructions,cache-misses for lines of the form "
+         "'main;foo 1200 1500 3'. Values may be fractional. All metrics are "
+         "aggregated and stored in the index and partial results.")  //
+        ("metric", po::value<std::string>(),
+         "The metric to apply the cutoff to and write, the first one by "
+         "default. A ratio of two metrics, e.g. instructions/cycles, writes "
+         "the ratio summed over each output line and applies the cutoff to "
+         "the second metric.")  //
+        ("drop-frames", po::value<std::string>(),
+         "Comma separated kinds of frames (kernel, jit, inlined, user) to "
+         "remove from every stack. Kinds are read from the _[k], _[j], and "
+         "_[i] annotations of stackcollapse scripts, frames without one are "
+         "user frames. Stacks without frames left are dropped.")  //
+        ("keep-only-frames", po::value<std::string>(),
+         "Comma separated kinds of frames to keep, removing all others.")  //
+        ("collapse-frames", po::value<std::string>(),
+         "Comma separated kinds of frames of which each run of consecutive "
+         "frames is replaced by its first frame, e.g. kernel to keep only the "
+         "entry point of kernel tails.")  //
+        ("sort", po::value<std::string>(),
+         "Write the lines in a canonical order: weight for decreasing "
+         "weight, or name for the frames from the root compared by name. "
+         "The default, input, groups the lines by lowest frame.")  //
+        ("split-by", po::value<std::string>(),
+         "Set to root-frame to write the stacks of each root frame, e.g. "
+         "each comm-pid/tid of a perf profile, to its own file OUTPUT.ROOT. "
+         "The groups are filtered in parallel, on --jobs threads or one per "
+         "core by default, and the cutoff is relative to each group. Set to "
+         "show to write the stacks matching each --show regular expression "
+         "to its own file OUTPUT.REGEX instead.")  //
+        ("normalize-root-frames", po::value<std::string>(),
+         "Reduce root frames of the form comm-pid/tid to comm-pid (process) "
+         "or comm (command), merging the stacks of the threads of a process "
+         "or of all processes of a command.")  //
+        ("plugin", po::value<std::vector<std::string>>()->composing(),
+         "Rewrite the stacks with a stage loaded from the shared library "
+         "LIBRARY[=ARGUMENT], see flamegraph_filter_plugin.h. Plugins run "
+         "after the built-in rewrites, in the order given. Disables "
+         "--cache-dir.")  //
+        ("rename", po::value<std::vector<std::string>>()->composing(),
+         "Rules of the form REGEX=REPLACEMENT applied in order to every frame "
+         "name before filtering, replacing each match of REGEX. The "
+         "replacement may refer to groups as $1, and \\= is a literal = in "
+         "REGEX. E.g. '\\.(cold|part\\.[0-9]+)$=' merges the clones of a "
+         "function with it. Stacks that become identical are merged.")  //
         ("output,o", po::value<std::string>(),
          "The name of the output file.")  //
-        ("input-file", po::value<std::string>(), "The name of the input file.");
+        ("stats",
+         "Print the time and heap allocations spent in each stage of the "
+         "filter to stderr. Hardware counters per input byte are included "
+         "when perf_event_open is available. Allocations are counted for the "
+         "whole process, so those of helper threads, e.g. the --progress "
+         "monitor, count towards whichever stage is running.")  //
+        ("progress",
+         "Periodically report the bytes processed, throughput, estimated time "
+         "remaining, and current stage to stderr.")  //
+        ("progress-interval", po::value<double>()->default_value(1.0),
+         "The number of seconds between --progress reports.")  //
+        ("memory-report",
+         "Print the memory used by the parsed stacks, broken down into line "
+         "text, frame strings, map nodes, and vectors, to stderr.")  //
+        ("index", po::value<std::string>(),
+         "Read the input through this binary index of interned frames and "
+         "merged stacks, creating it if it does not exist. If the input file "
+         "has grown by appending lines only the new lines are parsed and "
+         "merged into the index. Identical stacks are merged in the "
+         "output.")  //
+        ("interactive",
+         "Load the input once and read commands (show, focus, hide, cutoff, "
+         "limit, top, write) from stdin to refine the filter iteratively. The "
+         "other filter options set the initial state.")  //
+        ("serve", po::value<uint16_t>(),
+         "Instead of writing an output file, serve an interactive inverted "
+         "flamegraph on http://127.0.0.1:PORT/. Only the frames that are "
+         "visible at the current zoom level are sent to the browser. The "
+         "--stack-limit is ignored.")  //
+        ("emit-partial", po::value<std::string>(),
+         "Instead of writing an output file, write the aggregated frame "
+         "dictionary, stacks, and sample counts as a partial result to this "
+         "file, e.g. on each compute node.")  //
+        ("merge-partials",
+         po::value<std::vector<std::string>>()->multitoken()->composing(),
+         "Partial results written by --emit-partial to merge with the input "
+         "files, if any. Partials are merged by remapping their frame "
+         "dictionaries rather than parsing text, and the merged result can be "
+         "filtered or emitted as a partial again.")  //
+        ("categories",
+         "Instead of writing an output file, print how the samples of the "
+         "selected stacks split into categories: allocation, locking, mpi, "
+         "io, syscalls, any --category, and other. Self is the share of "
+         "stacks whose lowest frame that has a category is in the category, "
+         "inclusive the share of stacks with a frame in the category.")  //
+        ("category", po::value<std::vector<std::string>>()->composing(),
+         "A user category for --categories of the form NAME=REGEX. User "
+         "categories are checked before the built-in ones, in order.")  //
+        ("shm-publish", po::value<std::string>(),
+         "Instead of writing an output file, copy the parsed profile and its "
+         "indexes into the named POSIX shared memory segment so that other "
+         "processes can use it with --shm. The segment lives until removed "
+         "with --shm-unlink or a reboot.")  //
+        ("shm-mode", po::value<std::string>()->default_value("0640"),
+         "The octal permissions of the --shm-publish segment, independent of "
+         "the umask. Users need read permission to use it with --shm, so the "
+         "default lets the owner's group read it. Use 0644 to share it with "
+         "every user or 0600 to keep it private.")  //
+        ("shm", po::value<std::string>(),
+         "Use the profile in the named shared memory segment created with "
+         "--shm-publish instead of an input file. The segment is mapped "
+         "read-only, so concurrent processes share one copy and do not parse "
+         "anything.")  //
+        ("shm-unlink", po::value<std::string>(),
+         "Remove the named shared memory segment and exit.")  //
+        ("cache-dir", po::value<std::string>(),
+         "Cache the output in this directory, keyed by the contents of the "
+         "input file and the filter options. Repeated invocations copy the "
+         "cached output instead of filtering again.")  //
+        ("cache-max-megabytes", po::value<double>()->default_value(1024.0),
+         "The maximum size of the --cache-dir. The least recently used "
+         "entries are removed when it is exceeded.")  //
+        ("stats-json", po::value<std::string>(),
+         "Write the statistics collected by --stats as JSON to the given "
+         "file.")  //
+        ("input-list", po::value<std::string>(),
+         "A file listing further input files, one per line.")  //
+        ("jobs,j", po::value<size_t>()->default_value(1),
+         "The number of processes that parse the input files in parallel. "
+         "Each process aggregates a shard of the files and the partial "
+         "results are merged in a binary tree.")  //
+        ("numa",
+         "Bind the --jobs worker processes round-robin to the NUMA nodes so "
+         "that each one parses into memory local to its node.")  //
+        ("input-file", po::value<std::vector<std::string>>(),
+         "The names of the input files. The stacks of all files are "
+         "added up.");
 
     po::positional_options_description input_file_opt;
     input_file_opt.add("input-file", -1);
@@ -211,27 +5424,252 @@ int main(int argc, char* argv[]) {
       return 0;
     }
 
-    if (not args.count("output")) {
+    if (not args.count("output") and not args.count("serve") and
+        not args.count("categories") and
+        not args.count("interactive") and not args.count("shm-publish") and
+        not args.count("emit-partial") and
+        not args.count("shm-unlink")) {
       std::cerr << "You must set the output file.\n"
                 << options_description << "\n";
       std::exit(1);
     }
-    if (not args.count("input-file")) {
+    if (args.count("split-by") and
+        args["split-by"].as<std::string>() != "root-frame" and
+        args["split-by"].as<std::string>() != "show") {
+      throw std::invalid_argument("Unknown --split-by '" +
+                                  args["split-by"].as<std::string>() +
+                                  "', expected root-frame or show");
+    }
+    if (args.count("split-by") and
+        args["split-by"].as<std::string>() == "show" and
+        not args.count("show")) {
+      throw std::invalid_argument("--split-by show requires --show");
+    }
+    if (not(args["cache-max-megabytes"].as<double>() >= 0.0) or
+        args["cache-max-megabytes"].as<double>() * 1.0e6 >=
+            static_cast<double>(std::numeric_limits<size_t>::max())) {
+      throw std::invalid_argument(
+          "--cache-max-megabytes must be a non-negative size");
+    }
+    const std::vector<std::string> input_filenames =
+        get_input_filenames(args);
+    if (input_filenames.empty() and not args.count("shm") and
+        not args.count("merge-partials") and
+        not args.count("shm-unlink")) {
       std::cerr << "Must specify an input file.\n"
                 << options_description << "\n";
     }
+    const std::string input_filename =
+        input_filenames.empty() ? std::string{} : input_filenames.front();
+    size_t input_bytes = 0;
+    for (const auto& filename : input_filenames) {
+      input_bytes += get_file_size(filename);
+    }
     std::vector<std::string> regexes_to_show{};
     if (args.count("show")) {
       regexes_to_show = args["show"].as<std::vector<std::string>>();
     }
+    std::vector<std::string> regexes_to_focus{};
+    if (args.count("focus")) {
+      regexes_to_focus = args["focus"].as<std::vector<std::string>>();
+    }
+    std::vector<std::string> regexes_to_hide{};
+    if (args.count("hide")) {
+      regexes_to_hide = args["hide"].as<std::vector<std::string>>();
+    }
+    std::vector<std::string> patterns_to_match{};
+    if (args.count("match")) {
+      patterns_to_match = args["match"].as<std::vector<std::string>>();
+    }
+
+    if (args.count("shm-unlink")) {
+      unlink_shared_profile(args["shm-unlink"].as<std::string>());
+      return 0;
+    }
+    if (args.count("emit-partial")) {
+      write_partial_profile(args["emit-partial"].as<std::string>(),
+                            load_profile(args).profile);
+      return 0;
+    }
+    if (args.count("shm-publish")) {
+      const mode_t shared_memory_mode =
+          parse_shared_memory_mode(args["shm-mode"].as<std::string>());
+      publish_shared_profile(args["shm-publish"].as<std::string>(),
+                             shared_memory_mode, load_profile(args));
+      return 0;
+    }
 
-    write_filtered_stack_to_file(
-        shrink_to_stack_limit(
-            filter_stack(build_stack_map(args["input-file"].as<std::string>()),
-                         args["cutoff-percentage"].as<double>(),
-                         regexes_to_show),
-            args["stack-limit"].as<size_t>()),
-        args["output"].as<std::string>());
+    if (args.count("interactive")) {
+      run_interactive(load_profile(args), regexes_to_show, regexes_to_focus,
+                      regexes_to_hide, patterns_to_match,
+                      args["cutoff-percentage"].as<double>(),
+                      args["stack-limit"].as<size_t>(), std::cin, std::cout);
+      return 0;
+    }
+
+    if (args.count("serve")) {
+      const auto indexed_profile = load_profile(args);
+      const auto& profile = indexed_profile.profile;
+      FrameMatcher frame_matcher(profile);
+      const auto stack_ids =
+          select_stacks(profile, indexed_profile.frame_index, frame_matcher,
+                        regexes_to_focus, regexes_to_hide, patterns_to_match);
+      const auto frame_is_shown = shown_lowest_frames(
+          profile, frame_matcher, stack_ids,
+          args["cutoff-percentage"].as<double>(), regexes_to_show);
+      serve_leaf_tree(profile,
+                      stack_ids.size() == profile.number_of_stacks()
+                          ? indexed_profile.leaf_tree
+                          : build_leaf_tree(profile, stack_ids),
+                      frame_is_shown, args["serve"].as<uint16_t>());
+      return 0;
+    }
+
+    if (args.count("categories")) {
+      const auto indexed_profile = load_profile(args);
+      const auto& profile = indexed_profile.profile;
+      FrameMatcher frame_matcher(profile);
+      print_category_breakdown(
+          std::cout,
+          category_breakdown(
+              profile, frame_matcher,
+              select_stacks(profile, indexed_profile.frame_index,
+                            frame_matcher, regexes_to_focus, regexes_to_hide,
+                            patterns_to_match),
+              args.count("category")
+                  ? args["category"].as<std::vector<std::string>>()
+                  : std::vector<std::string>{}));
+      return 0;
+    }
+
+    std::unique_ptr<PipelineStats> pipeline_stats{};
+    if (args.count("stats") or args.count("stats-json")) {
+      pipeline_stats.reset(new PipelineStats{});
+      pipeline_stats->input_bytes = input_bytes;
+    }
+    PipelineStats* const stats = pipeline_stats.get();
+
+    std::unique_ptr<ProgressMonitor> progress_monitor{};
+    if (args.count("progress")) {
+      progress_monitor.reset(new ProgressMonitor(
+          input_bytes, args["progress-interval"].as<double>()));
+    }
+
+    CacheEntry cached_entry{};
+    std::vector<std::string> cached_filenames = input_filenames;
+    if (args.count("merge-partials")) {
+      const auto& partial_filenames =
+          args["merge-partials"].as<std::vector<std::string>>();
+      cached_filenames.insert(cached_filenames.end(),
+                              partial_filenames.begin(),
+                              partial_filenames.end());
+    }
+    const bool use_cache =
+        args.count("cache-dir") and not cached_filenames.empty() and
+        not args.count("shm") and not args.count("split-by") and
+        not args.count("plugin");
+    if (use_cache) {
+      cached_entry = run_stage(stats, "cache", [&args, &cached_filenames]() {
+        return cache_entry(cached_filenames, normalized_cache_options(args));
+      });
+      if (fetch_cached_output(args["cache-dir"].as<std::string>(),
+                              cached_entry, args["output"].as<std::string>())) {
+        progress_monitor.reset();
+        report_stats(args, stats);
+        return 0;
+      }
+    }
+
+    if (uses_profile(args)) {
+      const auto indexed_profile =
+          run_stage(stats, "index", [&args]() { return load_profile(args); });
+      const auto& profile = indexed_profile.profile;
+      FrameMatcher frame_matcher(profile);
+      if (args.count("memory-report")) {
+        print_profile_memory_report(std::cerr, indexed_profile, input_bytes);
+      }
+      const auto stack_ids = run_stage(stats, "select", [&]() {
+        return select_stacks(profile, indexed_profile.frame_index,
+                             frame_matcher, regexes_to_focus, regexes_to_hide,
+                             patterns_to_match);
+      });
+      const auto stack_limit = args["stack-limit"].as<size_t>();
+      if (args.count("split-by")) {
+        const size_t number_of_threads =
+            args["jobs"].defaulted()
+                ? std::max(1u, std::thread::hardware_concurrency())
+                : args["jobs"].as<size_t>();
+        // The frame matcher is not thread-safe, so the --show regular
+        // expressions are matched before the groups are split over threads
+        if (args["split-by"].as<std::string>() == "show") {
+          // A repeated --show would write the same file twice
+          std::vector<std::string> split_regexes{};
+          std::vector<std::vector<char>> matches_by_regex{};
+          for (const auto& regex : regexes_to_show) {
+            if (std::find(split_regexes.begin(), split_regexes.end(),
+                          regex) == split_regexes.end()) {
+              split_regexes.push_back(regex);
+              matches_by_regex.push_back(frame_matcher.matches(regex));
+            }
+          }
+          run_stage(stats, "split", [&]() {
+            write_split_by_show_regex(
+                indexed_profile, stack_ids, split_regexes, matches_by_regex,
+                args["cutoff-percentage"].as<double>(), stack_limit,
+                args["output"].as<std::string>(), number_of_threads);
+            return 0;
+          });
+        } else {
+          const auto frame_is_shown =
+              regexes_to_show.empty()
+                  ? std::vector<char>(profile.frames.size(), 1)
+                  : frame_matcher.matches_any(regexes_to_show);
+          run_stage(stats, "split", [&]() {
+            write_split_by_root_frame(
+                indexed_profile, stack_ids, frame_is_shown,
+                args["cutoff-percentage"].as<double>(), stack_limit,
+                args["output"].as<std::string>(), number_of_threads);
+            return 0;
+          });
+        }
+        progress_monitor.reset();
+        report_stats(args, stats);
+        return 0;
+      }
+      const auto frame_is_shown = run_stage(stats, "filter", [&]() {
+        return shown_lowest_frames(profile, frame_matcher, stack_ids,
+                                   args["cutoff-percentage"].as<double>(),
+                                   regexes_to_show);
+      });
+      run_stage(stats, "write", [&]() {
+        write_profile_view(indexed_profile, stack_ids, frame_is_shown,
+                           stack_limit, args["output"].as<std::string>());
+        return 0;
+      });
+    } else {
+      auto stack_map = run_stage(stats, "parse", [&input_filename]() {
+        return build_stack_map(input_filename);
+      });
+      if (args.count("memory-report")) {
+        print_memory_report(std::cerr, stack_map, input_bytes);
+      }
+      run_stage(stats, "write", [&]() {
+        write_filtered_stack_map(stack_map,
+                                 args["cutoff-percentage"].as<double>(),
+                                 regexes_to_show,
+                                 args["stack-limit"].as<size_t>(),
+                                 args["output"].as<std::string>());
+        return 0;
+      });
+    }
+    if (use_cache) {
+      const auto max_cache_bytes = static_cast<size_t>(
+          args["cache-max-megabytes"].as<double>() * 1.0e6);
+      store_cached_output(args["cache-dir"].as<std::string>(), cached_entry,
+                          args["output"].as<std::string>(), max_cache_bytes);
+    }
+    progress_monitor.reset();
+    report_stats(args, stats);
 
   } catch (std::exception& e) {
     std::cerr << "error: " << e.what() << "\n";
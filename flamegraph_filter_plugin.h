@@ -0,0 +1,99 @@
+/*!
+@file
+@copyright Nils Deppe 2018
+(See accompanying file LICENSE.md or copy at http://boost.org/LICENSE_1_0.txt)
+*/
+
+/*!
+ * \brief The C interface of stages loaded from shared libraries with
+ * `flamegraph_filter --plugin LIBRARY[=ARGUMENT]`.
+ *
+ * A plugin rewrites the stacks of the profile after the built-in rewrites
+ * (`--drop-frames`, `--normalize-root-frames`, `--rename`) and before any
+ * filtering. Stacks are handed over in batches as spans of frame IDs into the
+ * frame dictionary of the profile, so no frame names are copied. A plugin
+ * reads names through the host and adds new frames with `intern_frame`.
+ *
+ * Every plugin exports `fgf_stage_plugin_entry`, which returns a description
+ * of the plugin. The interface only changes by adding members at the end of
+ * the structures together with a new `FGF_PLUGIN_ABI_VERSION`, and the host
+ * rejects plugins built against a newer version than its own.
+ */
+
+#ifndef FLAMEGRAPH_FILTER_PLUGIN_H
+#define FLAMEGRAPH_FILTER_PLUGIN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FGF_PLUGIN_ABI_VERSION 1
+
+/*!
+ * \brief The name of the function every plugin exports
+ */
+#define FGF_STAGE_PLUGIN_ENTRY "fgf_stage_plugin_entry"
+
+/*!
+ * \brief Access to the frame dictionary of the profile being rewritten. Pass
+ * `context` as the first argument of every function.
+ */
+typedef struct fgf_host {
+  uint32_t abi_version;
+  void* context;
+  /* The number of frames in the dictionary, whose IDs are 0 to this - 1 */
+  uint32_t (*number_of_frames)(void* context);
+  /* The name of the frame, which is not null-terminated. It stays valid
+   * until intern_frame is called or the call of create or process_batch
+   * that read it returns, whichever is first, since the host adds frames
+   * between batches. It may be passed to intern_frame. Copy the name, or
+   * keep the frame ID, to use it later. */
+  const char* (*frame_name)(void* context, uint32_t frame_id, size_t* length);
+  /* Returns the ID of the frame with the name, adding it if it is new */
+  uint32_t (*intern_frame)(void* context, const char* name, size_t length);
+} fgf_host;
+
+/*!
+ * \brief A batch of stacks. Stack `i` has `stack_lengths[i]` frames starting
+ * at `frame_ids + stack_offsets[i]`, from the root to the lowest frame, and
+ * the values `values + i * number_of_metrics`.
+ *
+ * A plugin may change the frame IDs and values in place and shorten a stack by
+ * reducing its length. A length of zero drops the stack. Stacks that become
+ * identical are merged by the host.
+ */
+typedef struct fgf_stack_batch {
+  size_t number_of_stacks;
+  uint32_t* frame_ids;
+  const size_t* stack_offsets;
+  uint32_t* stack_lengths;
+  size_t number_of_metrics;
+  double* values;
+} fgf_stack_batch;
+
+/*!
+ * \brief The description of a plugin returned by `fgf_stage_plugin_entry`
+ */
+typedef struct fgf_stage_plugin {
+  /* FGF_PLUGIN_ABI_VERSION as the plugin was compiled */
+  uint32_t abi_version;
+  const char* name;
+  /* Returns the state passed to the other functions, or NULL on failure.
+   * `argument` is the text after `=` in the option, or empty. The host
+   * outlives the state. */
+  void* (*create)(const fgf_host* host, const char* argument);
+  /* Rewrites the batch in place, returning zero on success */
+  int (*process_batch)(void* state, fgf_stack_batch* batch);
+  void (*destroy)(void* state);
+} fgf_stage_plugin;
+
+typedef const fgf_stage_plugin* (*fgf_stage_plugin_entry_function)(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FLAMEGRAPH_FILTER_PLUGIN_H */